@@ -0,0 +1,502 @@
+/*****************************************************************************
+ *                                                                           *
+ * Copyright (C) 2016-2021, Greg Stevens, <greg@e-ctrl.com>                  *
+ *                                                                           *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell  *
+ * copies of this Software, and permit persons to whom this Software is      *
+ * furnished to do so.                                                       *
+ *                                                                           *
+ * This Software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY *
+ * KIND, either expressed or implied.                                        *
+ *                                                                           *
+ *****************************************************************************
+
+Description:
+
+	Benchmarks for ev-charger, so a slowdown in the I/O path shows up before it gets to a charger.
+
+	First the pieces that run every cycle are timed on their own: parsing the meter's response
+	(whole, and in small pieces as it comes off the network), the switching decision and rendering
+	a notification. Then whole cycles are run against mock Eagle-200 (post_manager) and Insteon hub
+	(/3?..., buffstatus.xml) servers started on the loopback interface, and the p50/p99 cycle time
+	and the allocations per cycle are reported.
+
+	ev-bench [-n cycles] [-l latency ms] [-c chunk bytes] [-e error %]
+
+	-l is how long the mock servers wait before answering, -c sends their responses in pieces of
+	that many bytes (0 = in one go) and -e makes that percentage of the requests fail, half of them
+	with a 500 and half by dropping the connection.
+
+	The cycle is ev-charger's own run_cycle(): ev-charger.c is compiled into this file with its
+	main() renamed.
+
+Use GNU toolchain; command line to compile:
+gcc -Wall -O2 ev-bench.c ev-decide.c ev-tariff.c ev-plan.c ev-eagle.c -oev-bench.exe -lcurl -lpthread -lrt
+
+*/
+
+#define _GNU_SOURCE
+#define main ev_charger_main
+#include "ev-charger.c"
+#undef main
+
+#include <netinet/tcp.h>
+
+/* Allocations are counted by wrapping the C library's allocator; only the thread running the cycles counts */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+static _Thread_local int counting;
+static unsigned long allocations;
+
+void *malloc(size_t size) {
+	if (counting) {
+		allocations++;
+	}
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+	if (counting) {
+		allocations++;
+	}
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+	if (counting) {
+		allocations++;
+	}
+	return __libc_realloc(p, size);
+}
+
+void free(void *p) {
+	__libc_free(p);
+}
+#else
+static int counting;
+static unsigned long allocations; /* Not counted without glibc */
+#endif
+
+/* The mock servers */
+struct mock {
+	int fd;             /* Listening socket */
+	int port;
+	int latency_ms;     /* Wait before every response */
+	int chunk;          /* Send responses in pieces of this many bytes; 0 = in one go */
+	int error_percent;  /* Fail this share of the requests */
+	unsigned seed;
+	unsigned long requests;
+} mock;
+
+static const char *mock_device_list =
+	"<DeviceList>\n<Device>\n<HardwareAddress>0x0013500100c5c0ab</HardwareAddress>\n<Manufacturer>Generic</Manufacturer>\n"
+	"<ModelId>electric_meter</ModelId>\n<Protocol>Zigbee</Protocol>\n<ConnectionStatus>Connected</ConnectionStatus>\n"
+	"</Device>\n</DeviceList>\n";
+
+static const char *mock_device_query =
+	"<Device>\n<DeviceDetails>\n<HardwareAddress>0x0013500100c5c0ab</HardwareAddress>\n<Name>Power Meter</Name>\n"
+	"<ModelId>electric_meter</ModelId>\n</DeviceDetails>\n<Components>\n<Component>\n<HardwareId>0x0</HardwareId>\n"
+	"<FixedId>0</FixedId>\n<Name>Main</Name>\n<Variables>\n<Variable>\n<Name>zigbee:InstantaneousDemand</Name>\n"
+	"<Value>%.3f</Value>\n<Units>kW</Units>\n<Description>Instantaneous Demand</Description>\n</Variable>\n"
+	"<Variable>\n<Name>zigbee:CurrentSummationDelivered</Name>\n<Value>%.3f</Value>\n<Units>kWh</Units>\n</Variable>\n"
+	"<Variable>\n<Name>zigbee:CurrentSummationReceived</Name>\n<Value>%.3f</Value>\n<Units>kWh</Units>\n</Variable>\n"
+	"<Variable>\n<Name>zigbee:Multiplier</Name>\n<Value>1</Value>\n</Variable>\n"
+	"<Variable>\n<Name>zigbee:Divisor</Name>\n<Value>1000</Value>\n</Variable>\n"
+	"</Variables>\n</Component>\n</Components>\n</Device>\n";
+
+static const char *mock_buffer = "<response><BS>0262418C4B0F1901060250418C4B1EB2C32B0002</BS></response>";
+
+static int mock_send(int fd, const char *data, size_t len) {
+
+	/* Write all of it. Returns 0 if the connection went away. */
+
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n <= 0) {
+			return 0;
+		}
+		data += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int mock_respond(int fd, int status, const char *body) {
+
+	/* Send the response, in chunked encoding if the responses are to come in pieces */
+
+	char head[256];
+	size_t len = strlen(body);
+
+	if (mock.chunk <= 0) {
+		snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Type: text/xml\r\nContent-Length: %zu\r\n\r\n", status, status == 200 ? "OK" : "Error", len);
+		return mock_send(fd, head, strlen(head)) && mock_send(fd, body, len);
+	}
+	snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Type: text/xml\r\nTransfer-Encoding: chunked\r\n\r\n", status, status == 200 ? "OK" : "Error");
+	if (!mock_send(fd, head, strlen(head))) {
+		return 0;
+	}
+	for (size_t done = 0; done < len; done += mock.chunk) {
+		size_t n = len - done < (size_t)mock.chunk ? len - done : (size_t)mock.chunk;
+		snprintf(head, sizeof(head), "%zx\r\n", n);
+		if (!mock_send(fd, head, strlen(head)) || !mock_send(fd, body + done, n) || !mock_send(fd, "\r\n", 2)) {
+			return 0;
+		}
+	}
+	return mock_send(fd, "0\r\n\r\n", 5);
+}
+
+static void *mock_connection(void *arg) {
+
+	/* Answer the requests on one connection until it is closed */
+
+	static const double demands[] = { -3.0, -0.5, 0.7, -2.2 };
+	int fd = (int)(intptr_t)arg;
+	char request[4096];
+	size_t have = 0;
+	int one = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	while (1) {
+		char *end;
+		ssize_t n;
+
+		/* Read the request headers, then the body if there is one */
+		request[have] = '\0';
+		while (!(end = strstr(request, "\r\n\r\n"))) {
+			if (have == sizeof(request) - 1 || (n = read(fd, request + have, sizeof(request) - 1 - have)) <= 0) {
+				close(fd);
+				return NULL;
+			}
+			have += n;
+			request[have] = '\0';
+		}
+		size_t head = end + 4 - request;
+		char *length = strcasestr(request, "Content-Length:");
+		size_t body = length && length < end ? (size_t)atol(length + 15) : 0;
+		while (have < head + body) {
+			if (have == sizeof(request) - 1 || (n = read(fd, request + have, sizeof(request) - 1 - have)) <= 0) {
+				close(fd);
+				return NULL;
+			}
+			have += n;
+		}
+		request[have] = '\0';
+
+		unsigned long number = __atomic_fetch_add(&mock.requests, 1, __ATOMIC_RELAXED);
+		if (mock.latency_ms > 0) {
+			usleep(mock.latency_ms * 1000);
+		}
+
+		int ok = 1;
+		unsigned seed = mock.seed + number;
+		if (mock.error_percent > 0 && (int)(rand_r(&seed) % 100) < mock.error_percent) {
+			if (number & 1) {
+				close(fd); // Drop the connection
+				return NULL;
+			}
+			ok = mock_respond(fd, 500, "");
+		} else if (!strncmp(request, "POST", 4)) {
+			char reply[2048];
+			if (strstr(request + head, "device_list")) {
+				ok = mock_respond(fd, 200, mock_device_list);
+			} else {
+				snprintf(reply, sizeof(reply), mock_device_query, demands[number % 4], 1000 + number * 0.01, 2000 + number * 0.02);
+				ok = mock_respond(fd, 200, reply);
+			}
+		} else if (strstr(request, "buffstatus.xml")) {
+			ok = mock_respond(fd, 200, mock_buffer);
+		} else {
+			ok = mock_respond(fd, 200, "");
+		}
+		if (!ok) {
+			close(fd);
+			return NULL;
+		}
+
+		/* Keep whatever came after this request for the next one */
+		memmove(request, request + head + body, have - head - body);
+		have -= head + body;
+	}
+}
+
+static void *mock_server(void *arg) {
+
+	/* Accept connections, each answered on its own thread */
+
+	while (1) {
+		int fd = accept(mock.fd, NULL, NULL);
+		pthread_t thread;
+
+		if (fd < 0) {
+			continue;
+		}
+		if (pthread_create(&thread, NULL, mock_connection, (void *)(intptr_t)fd) != 0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+static int mock_start() {
+
+	/* Listen on a free loopback port for both the gateway and the hub requests */
+
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	pthread_t thread;
+	int one = 1;
+
+	mock.fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (mock.fd < 0) {
+		return 0;
+	}
+	setsockopt(mock.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(mock.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(mock.fd, 16) < 0 ||
+	    getsockname(mock.fd, (struct sockaddr *)&addr, &len) < 0) {
+		return 0;
+	}
+	mock.port = ntohs(addr.sin_port);
+	return pthread_create(&thread, NULL, mock_server, NULL) == 0;
+}
+
+/* Timing */
+static double seconds_since(const struct timespec *start) {
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void report(const char *name, unsigned long ops, const struct timespec *start) {
+
+	double seconds = seconds_since(start);
+
+	printf("%-32s %12.1f ns/op %12.0f ops/s\n", name, seconds * 1e9 / ops, ops / seconds);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Microbenchmarks */
+static void bench_parse() {
+
+	/* Parse the meter's device_query response, whole and 16 bytes at a time */
+
+	char reply[2048];
+	struct eagle_parse p;
+	struct timespec start;
+	const unsigned long ops = 200000;
+	double sum = 0;
+
+	snprintf(reply, sizeof(reply), mock_device_query, -1.234, 1000.0, 2000.0);
+	size_t len = strlen(reply);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long i = 0; i < ops; i++) {
+		eagle_parse_reset(&p);
+		eagle_parse_feed(&p, reply, len);
+		sum += p.demand;
+	}
+	report("parse device_query (whole)", ops, &start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long i = 0; i < ops; i++) {
+		eagle_parse_reset(&p);
+		for (size_t done = 0; done < len; done += 16) {
+			eagle_parse_feed(&p, reply + done, len - done < 16 ? len - done : 16);
+		}
+		sum += p.demand;
+	}
+	report("parse device_query (16 B pieces)", ops, &start);
+	if (sum == 0) {
+		printf("parse failed\n");
+	}
+}
+
+static void bench_decide() {
+
+	/* The decision with the EV charger alone, and shared out among several loads */
+
+	struct decide_config config = { 0 };
+	struct decide_load one[1] = { { .kw = 1.4, .priority = 3, .value_charge = 1 } };
+	struct decide_load four[4] = {
+		{ .kw = 1.4, .priority = 3, .value_charge = 1 },
+		{ .kw = 1.1, .priority = 1, .min_on_seconds = 1800 },
+		{ .kw = 0.45, .priority = 2 },
+		{ .kw = 3.8, .priority = 1 },
+	};
+	struct decide_load *ones[1] = { &one[0] };
+	struct decide_load *fours[4] = { &four[0], &four[1], &four[2], &four[3] };
+	int want[4];
+	struct timespec start;
+	const unsigned long ops = 2000000;
+	unsigned long on = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long i = 0; i < ops; i++) {
+		decide(&config, ones, 1, (double)(i % 64) / 8 - 4, 0, i, want);
+		on += want[0];
+	}
+	report("decide (1 load)", ops, &start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long i = 0; i < ops / 10; i++) {
+		decide(&config, fours, 4, (double)(i % 64) / 8 - 8, 0, i, want);
+		on += want[1];
+	}
+	report("decide (4 loads)", ops / 10, &start);
+	if (on == 0) {
+		printf("decide never turned anything on\n");
+	}
+}
+
+static void bench_render() {
+
+	/* Render a whole notification and stream it the way curl pulls it from the read callback */
+
+	char buf[CURL_MAX_WRITE_SIZE];
+	struct message m;
+	struct timespec start;
+	const unsigned long ops = 200000;
+	size_t total = 0;
+
+	config_defaults(&settings.defaults);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long i = 0; i < ops; i++) {
+		size_t n;
+		message_render(&m, &settings.defaults, 0, ON, -1.234, (time_t)i);
+		do {
+			n = message_read(buf, 1, sizeof(buf), &m);
+			total += n;
+		} while (n > 0);
+	}
+	report("render notification", ops, &start);
+	if (total == 0) {
+		printf("render produced nothing\n");
+	}
+}
+
+/* End to end */
+static const struct tariff_tier flat_tier = { "Flat", 0.30, 0 };
+static const struct tariff flat_rate = { &flat_tier, 1, NULL, 0, NULL, 0 };
+
+static void bench_cycles(int cycles) {
+
+	/* Run whole cycles against the mock servers */
+
+	struct config *c;
+	double *ms = malloc(cycles * sizeof(*ms));
+	unsigned long failed = 0, before;
+	struct timespec start;
+	int stdout_fd = dup(STDOUT_FILENO);
+
+	if (!ms || !mock_start()) {
+		printf("Could not start the mock servers\n");
+		return;
+	}
+
+	/* Set ev-charger up as main() would, but with the compiled-in settings pointed at the mocks, and with
+	   no email, push or sample log */
+	mytime = time(NULL);
+	if (!loads_init() || !sites_init()) {
+		return;
+	}
+	config_defaults(&settings.defaults);
+	if (!(c = config_read("", &settings.defaults, 1))) {
+		return;
+	}
+	snprintf(c->gateway_url, sizeof(c->gateway_url), "http://127.0.0.1:%d/cgi-bin/post_manager", mock.port);
+	snprintf(c->hub_buffer_url, sizeof(c->hub_buffer_url), "http://127.0.0.1:%d/buffstatus.xml", mock.port);
+	snprintf(c->hub_clear_url, sizeof(c->hub_clear_url), "http://127.0.0.1:%d/1?XB=M=1", mock.port);
+	for (int i = 0; i < LOADS; i++) {
+		snprintf(c->loads[i].on_url, sizeof(c->loads[i].on_url), "http://127.0.0.1:%d/3?0262418C4B0F3202=I=3", mock.port);
+		snprintf(c->loads[i].off_url, sizeof(c->loads[i].off_url), "http://127.0.0.1:%d/3?0262418C4B0F3302=I=3", mock.port);
+		snprintf(c->loads[i].status_url, sizeof(c->loads[i].status_url), "http://127.0.0.1:%d/3?0262418C4B0F1901=I=3", mock.port);
+		c->loads[i].notify = 0;
+	}
+	c->demand_median_readings = 1; // The cycles come many to the second; smoothing still runs but doesn't hold the switches off
+	c->demand_tau_seconds = 0;
+	c->decide.on_band = c->decide.off_band = 0;
+	config_install(c);
+	if (!connections_init()) {
+		return;
+	}
+	tariff_compile(&tariffs, &flat_rate, mytime); // Never in the Value Charge time period, so the switches follow the readings
+	push.fd = push.client = -1;
+
+	/* The cycles print what they do; keep that out of the results */
+	fflush(stdout);
+	if (!freopen("/dev/null", "w", stdout)) {
+		return;
+	}
+	while (!get_hardware_address()) {
+		failed++;
+	}
+
+	counting = 1;
+	before = allocations;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < cycles; i++) {
+		struct timespec cycle;
+		clock_gettime(CLOCK_MONOTONIC, &cycle);
+		run_cycle(0);
+		ms[i] = seconds_since(&cycle) * 1000;
+		if (site->sample.flags & (SAMPLE_METER_FAILED | SAMPLE_SWITCH_FAILED)) {
+			failed++;
+		}
+	}
+	double seconds = seconds_since(&start);
+	counting = 0;
+
+	fflush(stdout);
+	dup2(stdout_fd, STDOUT_FILENO);
+	qsort(ms, cycles, sizeof(*ms), compare_doubles);
+	printf("%d cycles in %.3f s (latency %d ms, %s, %d%% errors): p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+	       cycles, seconds, mock.latency_ms, mock.chunk > 0 ? "chunked" : "whole responses", mock.error_percent,
+	       ms[cycles / 2], ms[(int)(cycles * 0.99)], ms[cycles - 1]);
+	printf("%lu requests, %lu failed cycles, %.1f allocations per cycle\n", mock.requests, failed, (double)(allocations - before) / cycles);
+	free(ms);
+}
+
+int main(int argc, char *argv[]) {
+
+	int cycles = 1000;
+	int opt;
+
+	mock.seed = 1;
+	while ((opt = getopt(argc, argv, "n:l:c:e:")) != -1) {
+		switch (opt) {
+		case 'n': cycles = atoi(optarg); break;
+		case 'l': mock.latency_ms = atoi(optarg); break;
+		case 'c': mock.chunk = atoi(optarg); break;
+		case 'e': mock.error_percent = atoi(optarg); break;
+		default:
+			fprintf(stderr, "Usage: %s [-n cycles] [-l latency ms] [-c chunk bytes] [-e error %%]\n", argv[0]);
+			return 2;
+		}
+	}
+	if (cycles < 1) {
+		cycles = 1;
+	}
+
+	bench_parse();
+	bench_decide();
+	bench_render();
+	bench_cycles(cycles);
+	return 0;
+}
@@ -0,0 +1,610 @@
+/*****************************************************************************
+ *                                                                           *
+ * Copyright (C) 2016-2021, Greg Stevens, <greg@e-ctrl.com>                  *
+ *                                                                           *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell  *
+ * copies of this Software, and permit persons to whom this Software is      *
+ * furnished to do so.                                                       *
+ *                                                                           *
+ * This Software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY *
+ * KIND, either expressed or implied.                                        *
+ *                                                                           *
+ *****************************************************************************
+
+Description:
+
+	ev-charger for a small board next to the panel (a Pi Zero, or an ESP32 with its sockets): the same
+	meter reading, smoothing, switching decision (ev-decide.c), time-of-use plan (ev-tariff.c) and
+	Eagle-200 parser (ev-eagle.c) as ev-charger, without libcurl, TLS, threads or a config file. The
+	gateway and the Insteon hub are plain HTTP on the LAN, so a small blocking HTTP/1.1 client over a
+	socket does for both. Everything it uses is in static memory: nothing is allocated after startup
+	(or at all), so what it needs is known at link time.
+
+	It runs one site with the loads in the table below, polling the meter; the settings are the
+	#defines, which can also be given on the compiler's command line. What ev-charger has on top
+	(the settings file, fleet mode, pushed readings, the PLM, EVSE current control, the charge plan,
+	the sample log, the metrics endpoint and the email/txt messages) is left out. Each switching is
+	handed to notify_event(), which does nothing here; a target with a mail or MQTT client of its own
+	can link in its own notify_event() to send it on.
+
+	Budget, with the Makefile's flags (gcc -Os on x86-64 Linux, "size ev-charger-lite"):
+	  flash  15 KB of code and constants: about 7 KB of functions, 3 KB of them the decision, tariff
+	         and parser, and the rest the messages, the POST bodies and the executable's own tables
+	  RAM    40 KB of static data: the tariff table is 30 KB (the tier and next change of each minute
+	         of the week, see struct tariff_table), decide()'s work tables 5 KB (DECIDE_LOADS 4 and
+	         SURPLUS_STEPS 400, so up to 20 kW of surplus is shared out), the HTTP buffers 2 KB and the
+	         parser, the device_query body and the stdout buffer about 2 KB
+	  stack  under 1 KB of its own, plus what the C library's printf and localtime_r take
+	It needs the C library's stdio, strtod, localtime_r/mktime (for the tariff; newlib has them too)
+	and BSD sockets (lwIP on the ESP32). On a PC against a mock gateway and hub it has its first
+	reading 15 ms after it is started, with 1.8 MB resident (0.9 MB linked -static), most of that the
+	C library; ev-charger takes 115 ms and 10.6 MB.
+
+Use GNU toolchain; command line to compile:
+gcc -Wall -Os -ffunction-sections -fdata-sections -Wl,--gc-sections -DDECIDE_LOADS=4 -DSURPLUS_STEPS=400 ev-charger-lite.c ev-decide.c ev-tariff.c ev-eagle.c -oev-charger-lite.exe
+Or run make ev-charger-lite, with LITE_FLAGS='-DGATEWAY_ADDRESS=\"192.168.1.4\" ...' for the settings.
+
+*/
+
+/* Include the needed libraries */
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "ev-charger.h"
+
+/* Define constants used; keep these the same as in ev-charger.c */
+#ifndef GATEWAY_ADDRESS
+#define GATEWAY_ADDRESS "192.168.1.4"          /* Eagle 200; an IPv4 address, there is no resolver */
+#endif
+#ifndef GATEWAY_PORT
+#define GATEWAY_PORT 80
+#endif
+#define GATEWAY_PATH "/cgi-bin/post_manager"
+#ifndef GATEWAY_AUTH
+#define GATEWAY_AUTH "nnnnnn:nnnnnnnnnnnnnnnn"  /* Cloud ID:Install Code */
+#endif
+#ifndef HUB_ADDRESS
+#define HUB_ADDRESS "192.168.1.3"              /* Insteon hub */
+#endif
+#ifndef HUB_PORT
+#define HUB_PORT 25105
+#endif
+#ifndef HUB_AUTH
+#define HUB_AUTH "user:password"
+#endif
+
+#ifndef SLEEP_SECONDS
+#define SLEEP_SECONDS 120         /* Time to wait before reading the meter again */
+#endif
+#define SAMPLE_VC_SECONDS 900     /* Longest interval during the Value Charge time period, when the decision can't change */
+#define SWITCHING_THRESHOLD 0     /* Turn loads on while house + loads <= this many kW */
+#define SWITCHING_ON_BAND 0.2
+#define SWITCHING_OFF_BAND 0.2
+#define DEMAND_MEDIAN_READINGS 3
+#define DEMAND_TAU_SECONDS 180
+#define RETRY_MIN_MS 1000         /* First wait before trying again at startup */
+#define RETRY_MAX_MS 60000        /* Longest wait before trying again */
+
+/* Every request is bounded: connecting, each wait for the peer to send or take more, and the whole request */
+#define CONNECT_TIMEOUT_MS 3000
+#define STALL_SECONDS 4
+#define REQUEST_TIMEOUT_SECONDS 10
+
+#define HTTP_REQUEST_MAX 1024     /* Longest request: the device_query POST with its headers */
+#define HTTP_HEADER_MAX 512       /* Longest response header kept; a longer one fails the request */
+#define HTTP_RECV_SIZE 256        /* Bytes read from the socket at a time */
+
+/* The loads: the paths of the hub's on and off URLs */
+struct lite_load {
+	const char *name;
+	const char *on_path;
+	const char *off_path;
+	struct decide_load decide;
+	int state;                 /* What the switch was last set to: ON, OFF, or -1 = not known */
+};
+
+static struct lite_load loads[] = {
+	{ "EV charger", "/3?0262418C4B0F3202=I=3", "/3?0262418C4B0F3302=I=3",
+	  { .kw = 1.4, .priority = 3, .value_charge = 1 }, -1 },
+};
+
+#define LOADS ((int)(sizeof(loads) / sizeof(loads[0])))
+#ifdef DECIDE_LOADS
+_Static_assert(LOADS <= DECIDE_LOADS, "ev-decide.c is built for fewer loads");
+#endif
+
+struct endpoint {
+	const char *address;
+	int port;
+	const char *auth;          /* user:password */
+	char authorization[64];    /* The same, base64 for the Authorization header */
+};
+
+/* Reading a response: the status line and headers, then the body (taken out of its chunks if it is sent
+   in them) fed to the parser as it comes */
+enum { CHUNK_SIZE, CHUNK_EXTENSION, CHUNK_DATA, CHUNK_END, CHUNK_LAST };
+
+struct http_reader {
+	char header[HTTP_HEADER_MAX];
+	size_t header_len;
+	int in_body;
+	int status;
+	int chunked;
+	long length;               /* Content-Length; -1 = up to the end of the connection */
+	long got;                  /* Body bytes so far */
+	int chunk_state;
+	unsigned long chunk_left;
+	int done;                  /* The whole body is in */
+	struct eagle_parse *parse; /* NULL = the body is not looked at */
+};
+
+static struct endpoint gateway = { GATEWAY_ADDRESS, GATEWAY_PORT, GATEWAY_AUTH };
+static struct endpoint hub = { HUB_ADDRESS, HUB_PORT, HUB_AUTH };
+static struct http_reader reader;
+static char request[HTTP_REQUEST_MAX];
+static char meter_post_body[640];
+static struct eagle_parse parse;
+static struct tariff_table tariffs;
+static struct demand_filter smoothing = { DEMAND_MEDIAN_READINGS, DEMAND_TAU_SECONDS };
+static const struct decide_config config = { SWITCHING_THRESHOLD, SWITCHING_ON_BAND, SWITCHING_OFF_BAND };
+static struct decide_load *load_decisions[LOADS];
+static char stdout_buffer[512];
+static time_t mytime;
+
+#define log_info(...) log_line(__VA_ARGS__)
+#define log_error(...) log_line(__VA_ARGS__)
+
+static void log_line(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+static void log_line(const char *format, ...) {
+
+	/* A line of the log, with the date in front as ev-charger has it */
+
+	time_t now = time(NULL);
+	struct tm tm;
+	va_list args;
+
+	localtime_r(&now, &tm);
+	printf("\n%04d-%02d-%02d %02d:%02d:%02d\n", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	fflush(stdout);
+}
+
+void notify_event(const char *load, int event, double demand) __attribute__((weak));
+
+void notify_event(const char *load, int event, double demand) {
+
+	/* A load was switched (event is decide_apply()'s); link in another notify_event() to send it on */
+
+	(void)load;
+	(void)event;
+	(void)demand;
+}
+
+static void base64(const char *in, char *out, size_t size) {
+
+	/* Encode in for the Authorization header; cut short if out is too small */
+
+	static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t len = strlen(in), o = 0;
+
+	for (size_t i = 0; i < len && o + 5 <= size; i += 3) {
+		unsigned long n = (unsigned char)in[i] << 16;
+		n |= i + 1 < len ? (unsigned char)in[i + 1] << 8 : 0;
+		n |= i + 2 < len ? (unsigned char)in[i + 2] : 0;
+		out[o++] = digits[(n >> 18) & 63];
+		out[o++] = digits[(n >> 12) & 63];
+		out[o++] = i + 1 < len ? digits[(n >> 6) & 63] : '=';
+		out[o++] = i + 2 < len ? digits[n & 63] : '=';
+	}
+	out[o] = '\0';
+}
+
+static int http_connect(const struct endpoint *e) {
+
+	/* Open a connection to the endpoint, waiting no more than CONNECT_TIMEOUT_MS. Returns the socket, or -1. */
+
+	struct sockaddr_in addr;
+	struct timeval stall = { STALL_SECONDS, 0 };
+	struct pollfd pfd;
+	int fd, flags, error = 0;
+	socklen_t error_len = sizeof(error);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(e->port);
+	if (inet_pton(AF_INET, e->address, &addr.sin_addr) != 1) {
+		log_error("http_connect: %s is not an IPv4 address.\n", e->address);
+		return -1;
+	}
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		log_error("http_connect: socket: %s.\n", strerror(errno));
+		return -1;
+	}
+	flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		if (errno != EINPROGRESS) {
+			error = errno;
+		} else {
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, CONNECT_TIMEOUT_MS) != 1) {
+				error = ETIMEDOUT;
+			} else {
+				getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+			}
+		}
+	}
+	if (error) {
+		log_error("http_connect: %s:%d: %s.\n", e->address, e->port, strerror(error));
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, flags);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &stall, sizeof(stall));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &stall, sizeof(stall));
+	return fd;
+}
+
+static const char *http_header(const char *name) {
+
+	/* The value of a response header, or NULL */
+
+	size_t len = strlen(name);
+
+	for (const char *line = strstr(reader.header, "\r\n"); line; line = strstr(line, "\r\n")) {
+		line += 2;
+		if (!strncasecmp(line, name, len) && line[len] == ':') {
+			for (line += len + 1; *line == ' ' || *line == '\t'; line++) {
+			}
+			return line;
+		}
+	}
+	return NULL;
+}
+
+static int http_headers_done() {
+
+	/* The status line and headers are in: see how the body comes */
+
+	const char *value;
+
+	if (sscanf(reader.header, "HTTP/%*d.%*d %d", &reader.status) != 1) {
+		return 0;
+	}
+	value = http_header("Transfer-Encoding");
+	reader.chunked = value && !strncasecmp(value, "chunked", 7);
+	value = http_header("Content-Length");
+	reader.length = value && !reader.chunked ? strtol(value, NULL, 10) : -1;
+	reader.done = reader.length == 0;
+	reader.in_body = 1;
+	return 1;
+}
+
+static void http_body(const char *data, size_t len) {
+
+	/* Take the next piece of the body out of its chunks, if it is chunked, and hand it to the parser */
+
+	if (!reader.chunked) {
+		if (reader.length >= 0 && (long)len > reader.length - reader.got) {
+			len = reader.length - reader.got;
+		}
+		if (reader.parse) {
+			eagle_parse_feed(reader.parse, data, len);
+		}
+		reader.got += len;
+		reader.done = reader.length >= 0 && reader.got >= reader.length;
+		return;
+	}
+	for (size_t i = 0; i < len && !reader.done; i++) {
+		char c = data[i];
+
+		switch (reader.chunk_state) {
+		case CHUNK_SIZE:
+		case CHUNK_EXTENSION:
+			if (c == '\n') {
+				reader.chunk_state = reader.chunk_left ? CHUNK_DATA : CHUNK_LAST;
+			} else if (reader.chunk_state == CHUNK_SIZE && c >= '0' && c <= '9') {
+				reader.chunk_left = reader.chunk_left * 16 + (c - '0');
+			} else if (reader.chunk_state == CHUNK_SIZE && ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')) {
+				reader.chunk_left = reader.chunk_left * 16 + ((c | 0x20) - 'a' + 10);
+			} else if (c != '\r') {
+				reader.chunk_state = CHUNK_EXTENSION; // ;name=value after the size
+			}
+			break;
+		case CHUNK_DATA: {
+			size_t n = len - i < reader.chunk_left ? len - i : reader.chunk_left;
+			if (reader.parse) {
+				eagle_parse_feed(reader.parse, data + i, n);
+			}
+			reader.got += n;
+			reader.chunk_left -= n;
+			i += n - 1;
+			if (!reader.chunk_left) {
+				reader.chunk_state = CHUNK_END;
+			}
+			break;
+		}
+		case CHUNK_END:
+			if (c == '\n') {
+				reader.chunk_state = CHUNK_SIZE; // The CRLF after the chunk's data
+			}
+			break;
+		case CHUNK_LAST:
+			reader.done = 1; // Trailers after the last chunk are not looked at
+			break;
+		}
+	}
+	if (reader.chunk_state == CHUNK_LAST) {
+		reader.done = 1;
+	}
+}
+
+static int http_request(struct endpoint *e, const char *path, const char *body, struct eagle_parse *p) {
+
+	/* Send a GET (body NULL) or a POST of XML to the endpoint and read the response, feeding the body to p
+	   if it is not NULL. Returns the HTTP status, or 0 if the request failed. */
+
+	static char data[HTTP_RECV_SIZE];
+	struct timespec start, now;
+	int fd, len;
+	size_t sent = 0;
+
+	if (body) {
+		len = snprintf(request, sizeof(request), "POST %s HTTP/1.1\r\nHost: %s\r\nAuthorization: Basic %s\r\nConnection: close\r\n"
+		               "Content-Type: text/xml\r\nContent-Length: %zu\r\n\r\n%s", path, e->address, e->authorization, strlen(body), body);
+	} else {
+		len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nAuthorization: Basic %s\r\nConnection: close\r\n\r\n",
+		               path, e->address, e->authorization);
+	}
+	if (len < 0 || len >= (int)sizeof(request)) {
+		log_error("http_request: the request for %s is longer than %d bytes.\n", path, HTTP_REQUEST_MAX);
+		return 0;
+	}
+	fd = http_connect(e);
+	if (fd < 0) {
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (sent < (size_t)len) {
+#ifdef MSG_NOSIGNAL
+		ssize_t n = send(fd, request + sent, len - sent, MSG_NOSIGNAL);
+#else
+		ssize_t n = send(fd, request + sent, len - sent, 0);
+#endif
+		if (n <= 0) {
+			log_error("http_request: sending to %s: %s.\n", e->address, n < 0 ? strerror(errno) : "connection closed");
+			close(fd);
+			return 0;
+		}
+		sent += n;
+	}
+
+	memset(&reader, 0, sizeof(reader));
+	reader.parse = p;
+	while (!reader.done) {
+		ssize_t n = recv(fd, data, sizeof(data), 0);
+		size_t i = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (n < 0 || now.tv_sec - start.tv_sec > REQUEST_TIMEOUT_SECONDS) {
+			log_error("http_request: reading from %s: %s.\n", e->address, n < 0 ? strerror(errno) : "timed out");
+			close(fd);
+			return 0;
+		}
+		if (n == 0) {
+			break; // Connection closed: the end of a body without a length
+		}
+		while (!reader.in_body && i < (size_t)n) {
+			if (reader.header_len == sizeof(reader.header) - 1) {
+				log_error("http_request: response header from %s is longer than %d bytes.\n", e->address, HTTP_HEADER_MAX);
+				close(fd);
+				return 0;
+			}
+			reader.header[reader.header_len++] = data[i++];
+			reader.header[reader.header_len] = '\0';
+			if (reader.header_len >= 4 && !memcmp(reader.header + reader.header_len - 4, "\r\n\r\n", 4) && !http_headers_done()) {
+				log_error("http_request: bad response from %s.\n", e->address);
+				close(fd);
+				return 0;
+			}
+		}
+		if (reader.in_body && i < (size_t)n) {
+			http_body(data + i, n - i);
+		}
+	}
+	close(fd);
+	if (!reader.in_body || (!reader.done && (reader.chunked || reader.length >= 0))) {
+		log_error("http_request: the response from %s was cut short.\n", e->address);
+		return 0;
+	}
+	return reader.status;
+}
+
+static long backoff_ms(int tries) {
+
+	/* How long to wait before trying again after this many failures in a row, as in ev-charger */
+
+	long ms = RETRY_MAX_MS;
+
+	if (tries < 20 && ((long)RETRY_MIN_MS << (tries - 1)) < RETRY_MAX_MS) {
+		ms = (long)RETRY_MIN_MS << (tries - 1);
+	}
+	return ms / 2 + random() % (ms / 2 + 1);
+}
+
+static int switch_load(struct lite_load *l, int mode) {
+
+	/* Send the load's on or off command to the hub, unless the switch was already set to that. Returns mode
+	   if the hub took it, -1 if not. */
+
+	int status;
+
+	if (l->state == mode) {
+		return mode;
+	}
+	status = http_request(&hub, mode == ON ? l->on_path : l->off_path, NULL, NULL);
+	if (status != 200) {
+		if (status) {
+			log_error("switch_load: the hub answered %d to the %s switch %s command.\n", status, l->name, mode == ON ? "on" : "off");
+		}
+		l->state = -1; // It may or may not have heard it
+		return -1;
+	}
+	l->state = mode;
+	return mode;
+}
+
+static int get_hardware_address() {
+
+	/* Ask the gateway for its meter's Hardware Address and build the device_query with it. Returns 1 if it has it. */
+
+	eagle_parse_reset(&parse);
+	if (http_request(&gateway, GATEWAY_PATH, ha_post_body, &parse) != 200 || !parse.have_address) {
+		return 0;
+	}
+	snprintf(meter_post_body, sizeof(meter_post_body), "%s%s%s", meter_post_body_pre, parse.hardware_address, meter_post_body_suf);
+	log_info("Read the meter's Hardware Address: %s\n", parse.hardware_address);
+	return 1;
+}
+
+static int get_meter_reading(double *demand) {
+
+	/* Read the meter's Instantaneous Demand. Returns 1 if it has it. */
+
+	int status;
+
+	eagle_parse_reset(&parse);
+	status = http_request(&gateway, GATEWAY_PATH, meter_post_body, &parse);
+	if (status != 200) {
+		if (status) {
+			log_error("get_meter_reading: the gateway answered %d.\n", status);
+		}
+		return 0;
+	}
+	if (!parse.have_demand) {
+		log_error("No <Value> token for the <zigbee:InstantaneousDemand> token in %zu byte POST response.\n", parse.bytes);
+		return 0;
+	}
+	*demand = parse.demand;
+	return 1;
+}
+
+static void startup() {
+
+	/* Turn the value charge loads on and get the meter's Hardware Address, each tried again with backoff */
+
+	int tries = 0;
+
+	srandom(time(NULL) ^ getpid());
+	for (int i = 0; i < LOADS; i++) {
+		struct lite_load *l = &loads[i];
+		load_decisions[i] = &l->decide;
+		if (!l->decide.value_charge) {
+			continue;
+		}
+		log_info("Turning on %s switch at startup...\n", l->name);
+		for (tries = 1; switch_load(l, ON) != ON; tries++) {
+			long wait = backoff_ms(tries);
+			log_error("Could not turn %s switch on at startup.\nTrying again in %.1f seconds...\n", l->name, wait / 1000.0);
+			usleep(wait * 1000);
+		}
+		l->decide.mode = ON_STARTUP;
+		l->decide.changed = time(NULL);
+		log_info("Turned %s switch on at startup.\n", l->name);
+	}
+
+	log_info("Reading the gateway for the meter's Hardware Address at startup...\n");
+	for (tries = 1; !get_hardware_address(); tries++) {
+		long wait = backoff_ms(tries);
+		log_error("Could not read the meter's Hardware Address.\nTrying again in %.1f seconds...\n", wait / 1000.0);
+		usleep(wait * 1000);
+	}
+}
+
+static int run_cycle() {
+
+	/* One cycle: read the meter, decide which loads to run on it and switch them. Returns how many seconds
+	   to wait before the next one. */
+
+	int want[LOADS];
+	double demand, smoothed;
+	int value_charge, to_change;
+
+	mytime = time(NULL);
+	if (!get_meter_reading(&demand)) {
+		return SLEEP_SECONDS;
+	}
+	value_charge = tariff_at(&tariffs, mytime)->value_charge;
+	smoothed = demand_filter_add(&smoothing, load_decisions, LOADS, demand, mytime);
+	decide(&config, load_decisions, LOADS, smoothed, value_charge, mytime, want);
+
+	for (int i = 0; i < LOADS; i++) {
+		struct lite_load *l = &loads[i];
+		int target = decide_target(&l->decide, want[i], value_charge);
+		int result = switch_load(l, want[i] ? ON : OFF);
+		int event = decide_apply(&l->decide, target, result, mytime);
+
+		switch (event) {
+		case ON_VC:
+			log_info("Turned %s switch on as it is now in PG&E's lowest cost tier.\n", l->name);
+			break;
+		case ON:
+			log_info("Turned %s switch on as the solar panels are generating more than the house usage plus the %s usage.\n", l->name, l->name);
+			break;
+		case OFF_VALUE:
+			log_info("Turned %s switch off as it is not in PG&E's lowest cost tier.\n", l->name);
+			break;
+		case OFF_CURRENT:
+			log_info("Turned %s switch off as the house usage plus the %s usage is more than %g kW.\n", l->name, l->name, config.threshold);
+			break;
+		case ON_ERROR:
+		case ON_VC_ERROR:
+		case OFF_ERROR:
+			log_error("Could not turn %s switch %s.\n", l->name, event == OFF_ERROR ? "off" : "on");
+			break;
+		}
+		if (event >= 0) {
+			notify_event(l->name, event, demand);
+		}
+	}
+
+	log_info("Meter reading: %.3f kW (smoothed %.3f kW).\n", demand, smoothed);
+	for (int i = 0; i < LOADS; i++) {
+		printf("%s switch is %s.\n", loads[i].name, loads[i].decide.mode == ON_VC ? "on (Value Charge time period)" : loads[i].decide.mode != OFF ? "on" : "off");
+	}
+	fflush(stdout);
+
+	/* Never sleep past the next change of tier */
+	to_change = (int)(tariff_next_change(&tariffs, mytime) - mytime) + 1;
+	return value_charge ? (SAMPLE_VC_SECONDS < to_change ? SAMPLE_VC_SECONDS : to_change) : (SLEEP_SECONDS < to_change ? SLEEP_SECONDS : to_change);
+}
+
+int main() {
+
+	setvbuf(stdout, stdout_buffer, _IOFBF, sizeof(stdout_buffer)); // So stdio doesn't allocate one
+	base64(gateway.auth, gateway.authorization, sizeof(gateway.authorization));
+	base64(hub.auth, hub.authorization, sizeof(hub.authorization));
+	tariff_compile(&tariffs, &tariff_plan, time(NULL));
+
+	startup();
+	while (1) {
+		sleep(run_cycle());
+	}
+	return 0;
+}
@@ -0,0 +1,376 @@
+/*****************************************************************************
+ *                                                                           *
+ * Copyright (C) 2016-2021, Greg Stevens, <greg@e-ctrl.com>                  *
+ *                                                                           *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell  *
+ * copies of this Software, and permit persons to whom this Software is      *
+ * furnished to do so.                                                       *
+ *                                                                           *
+ * This Software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY *
+ * KIND, either expressed or implied.                                        *
+ *                                                                           *
+ *****************************************************************************
+
+Description:
+
+	Definitions shared by ev-charger and the tools that read what it records or replay its decisions.
+
+*/
+
+#ifndef EV_CHARGER_H
+#define EV_CHARGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+enum { /* Modes of EV charger */
+   OFF,
+   ON,
+   ON_ERROR,
+   OFF_ERROR,
+   ON_VC,
+   ON_VC_ERROR,
+   ON_METER,     /* No longer used; kept so the modes recorded in the sample log keep their numbers */
+   OFF_CURRENT,
+   OFF_VALUE,
+   ON_STARTUP,
+};
+
+/* The switching decision (ev-decide.c). It only works on what it is given, with no I/O and no clock,
+   so ev-replay can run recorded readings through exactly the logic ev-charger uses. */
+#define MAX_LOADS 32 /* The sample log records which loads are on as a 32 bit mask */
+
+struct decide_config {
+	double threshold;              /* Turn loads on while house + loads <= this many kW (SWITCHING_THRESHOLD) */
+	double on_band;                /* Hysteresis: a load that is off needs this many kW more surplus than it draws to be turned on */
+	double off_band;               /* and one that is on is kept on until the surplus is this many kW short of what it draws */
+};
+
+struct decide_load {
+	/* Settings */
+	double kw;                     /* Number of kilowatts the load draws when on */
+	int priority;                  /* Weight when sharing out the surplus; higher is more important */
+	int min_on_seconds;            /* Once on, keep it on at least this long */
+	int min_off_seconds;           /* Once off, keep it off at least this long */
+	int value_charge;              /* 1 = also turn on during the Value Charge time period */
+	int held;                      /* 1 or -1 = held on or off by the charge plan (see ev-plan.c); 0 = decided here */
+
+	/* State */
+	double draw_kw;                /* What it draws when on if that varies (an EVSE's current setpoint); 0 = kw */
+	int mode;                      /* ON_STARTUP, ON, ON_VC or OFF */
+	int64_t changed;               /* Unix time it was last switched on or off */
+	int raw_want;                  /* What the raw reading wanted last cycle, for decide_avoided() */
+};
+
+double decide(const struct decide_config *config, struct decide_load *const loads[], int n, double demand, int value_charge, int64_t now, int want[]);
+int decide_target(const struct decide_load *load, int want, int value_charge);
+int decide_apply(struct decide_load *load, int target, int result, int64_t now);
+int decide_avoided(const struct decide_config *config, struct decide_load *const loads[], int n, double demand, int value_charge, int64_t now, const int want[]);
+
+static inline double decide_draw(const struct decide_load *load) {
+
+	/* What the load draws while it is on */
+
+	return load->draw_kw > 0 ? load->draw_kw : load->kw;
+}
+
+/* Current control of a load that takes a setpoint (an EVSE): while it is on, each reading moves the setpoint
+   to what the surplus can carry. Its kw is what it draws at min_amps, which is what decide() turns it on for. */
+struct current_control {
+	/* Settings */
+	int min_amps;                  /* Lowest setpoint; the EVSE can't charge below this (6 A for J1772) */
+	int max_amps;
+	int step_amps;                 /* Most the setpoint goes up by from one reading to the next; 0 = no limit */
+	double volts;
+
+	/* State */
+	int amps;                      /* The setpoint now; 0 = off */
+};
+
+int current_control_next(struct current_control *c, double available_kw, int full);
+
+/* Smoothing of the meter readings before they are decided on, so a cloud passing over doesn't switch
+   the loads off and on again. The loads that are on are taken out of each reading, so what is smoothed
+   is the house's own draw; a median of the last few readings drops single spikes and a moving average
+   with a time constant (readings don't come at a fixed interval) evens out the rest. */
+#define DEMAND_WINDOW 8                /* Most readings the median can be taken over */
+
+struct demand_filter {
+	/* Settings */
+	int median;                    /* Take the median of this many readings (1 to DEMAND_WINDOW); 1 = none */
+	double tau_seconds;            /* Time constant of the moving average; 0 = none */
+
+	/* State */
+	float recent[DEMAND_WINDOW];   /* The last readings of the house alone, oldest overwritten first */
+	int count;                     /* Readings added, up to DEMAND_WINDOW */
+	int next;                      /* Where the next one goes in recent[] */
+	double house;                  /* The smoothed draw of the house alone */
+	int64_t time;                  /* Unix time of the last reading added */
+};
+
+double demand_filter_add(struct demand_filter *f, struct decide_load *const loads[], int n, double demand, int64_t now);
+
+/* Energy through the meter between readings, worked out from the summation registers that come with the
+   demand in each reading. The registers only count up; one that goes back (a new meter, or the gateway
+   restarted) starts the accounting over from that reading. */
+struct energy_account {
+	int have;                      /* There is a previous reading to take the deltas from */
+	double delivered;              /* Registers at the previous reading, kWh: from the grid */
+	double received;               /* and sent to the grid */
+	int64_t time;                  /* Unix time of the previous reading */
+
+	/* The last interval */
+	double interval_hours;
+	double net_export_kwh;         /* Sent minus drawn; negative when the house drew more */
+	double net_export_kw;          /* Its average over the interval */
+
+	/* Since the accounting started */
+	double imported_kwh;
+	double exported_kwh;
+};
+
+int energy_account_add(struct energy_account *a, double delivered, double received, int64_t now);
+
+/* The gateway's POST Responses (and the messages it pushes) are parsed as they arrive instead of being
+   buffered (ev-eagle.c); what is wanted from them is picked out into the struct. */
+#define XML_TOKEN_MAX 64 /* Longest tag name or element text kept; longer ones are truncated */
+
+struct eagle_parse {
+	int in_tag;                 /* Inside <...> */
+	int closing;                /* The tag is an end tag </...> */
+	int tag_done;               /* Past the tag name, skipping attributes */
+	char tag[XML_TOKEN_MAX];    /* Name of the current tag */
+	size_t tag_len;
+	char text[XML_TOKEN_MAX];   /* Text of the current element */
+	size_t text_len;
+	char name[XML_TOKEN_MAX];   /* Last <Name>, tells which variable a <Value> belongs to */
+	char model[XML_TOKEN_MAX];  /* <ModelId> of the current device */
+	char device_address[19];    /* <HardwareAddress> of the current device */
+	size_t bytes;               /* Size of the response so far */
+
+	/* What was found */
+	int have_address;
+	char hardware_address[19];
+	int have_demand;
+	double demand;              /* zigbee:InstantaneousDemand in kW */
+	double multiplier;
+	double divisor;
+	int have_raw_demand;
+	int raw_demand;             /* <Demand> of a pushed <InstantaneousDemand> message */
+	int summation;              /* Registers found: 1 = delivered, 2 = received */
+	int raw_summation;          /* They are raw register values to be scaled by the multiplier and divisor */
+	double delivered;           /* zigbee:CurrentSummationDelivered, kWh from the grid */
+	double received;            /* zigbee:CurrentSummationReceived, kWh sent to the grid */
+};
+
+/* The POST bodies: a device_list for the meter's Hardware Address, and a device_query for its readings,
+   which is the pre part, the address and the suf part */
+extern const char *const ha_post_body;
+extern const char *const meter_post_body_pre;
+extern const char *const meter_post_body_suf;
+
+void eagle_parse_reset(struct eagle_parse *p);
+void eagle_parse_feed(struct eagle_parse *p, const char *data, size_t len);
+int eagle_parse_summation(const struct eagle_parse *p, double *delivered, double *received);
+
+/* Time-of-use plan (ev-tariff.c). Rules put minutes of the day in tiers for some months and days;
+   tariff_compile() turns them into the tier of every minute of a week of real time. */
+#define TARIFF_MINUTES (7 * 24 * 60)         /* A table covers a week */
+#define TARIFF_MONTH(m) (1u << ((m) - 1))    /* Month 1 to 12, for tariff_rule.months */
+#define TARIFF_ALL_MONTHS 0xfffu
+#define TARIFF_HOLIDAY 0x80u                 /* Days of the week are 1 << tm_wday; holidays match this instead */
+#define TARIFF_WEEKDAYS 0x3eu
+#define TARIFF_WEEKENDS (0x41u | TARIFF_HOLIDAY)
+#define TARIFF_ALL_DAYS 0xffu
+
+struct tariff_tier {
+	const char *name;
+	double rate;                   /* $ per kWh */
+	int value_charge;              /* 1 = the least expensive tier, when value charge loads are turned on */
+};
+
+struct tariff_rule {
+	int tier;                      /* Index in the tiers */
+	unsigned months;               /* TARIFF_MONTH() bits */
+	unsigned days;                 /* TARIFF_ day bits */
+	int start_minute;              /* Minute of the day it starts at */
+	int end_minute;                /* Minute it ends at (not included); less than start_minute goes past midnight */
+};
+
+struct tariff {
+	const struct tariff_tier *tiers;
+	int ntiers;
+	const struct tariff_rule *rules;   /* Later rules win; minutes no rule covers are in the first tier */
+	int nrules;
+	const int *holidays;               /* MMDD every year or YYYYMMDD */
+	int nholidays;
+};
+
+struct tariff_table {
+	const struct tariff *tariff;
+	int64_t start;                     /* Unix time of the first minute */
+	uint8_t tier[TARIFF_MINUTES];      /* Tier of each minute */
+	uint16_t next[TARIFF_MINUTES];     /* Minute the tier next changes at; TARIFF_MINUTES = not this week */
+};
+
+extern const struct tariff tariff_plan;
+void tariff_compile(struct tariff_table *table, const struct tariff *tariff, int64_t when);
+
+static inline int tariff_minute(struct tariff_table *table, int64_t when) {
+
+	/* Index of the minute in the table, compiling it for the week from 'when' if it isn't covered */
+
+	uint64_t minute = (uint64_t)(when - table->start) / 60;
+
+	if (when < table->start || minute >= TARIFF_MINUTES) {
+		tariff_compile(table, table->tariff, when);
+		minute = (uint64_t)(when - table->start) / 60;
+	}
+	return (int)minute;
+}
+
+static inline const struct tariff_tier *tariff_at(struct tariff_table *table, int64_t when) {
+
+	/* The tier in effect at the time */
+
+	return &table->tariff->tiers[table->tier[tariff_minute(table, when)]];
+}
+
+static inline int64_t tariff_next_change(struct tariff_table *table, int64_t when) {
+
+	/* When the tier in effect at the time next changes (at the latest the end of the table's week) */
+
+	return table->start + (int64_t)table->next[tariff_minute(table, when)] * 60;
+}
+
+/* Day-ahead charge plan (ev-plan.c). The day up to when the car has to be ready is cut into slots; with
+   the expected meter reading of each slot (from the solar forecast) and the tariff, plan_solve() works out
+   the cheapest way to get the charging needed, as a table with the choice for every slot, charging still
+   needed and whether the load was on before, so the plan holds however the charging actually goes. */
+#define PLAN_SLOT_SECONDS 900
+#define PLAN_SLOTS 96                  /* A day of slots */
+#define PLAN_SHORTFALL_COST 1000       /* $ per slot of charging still needed at the end, which the plan avoids first */
+
+struct plan {
+	/* Set before plan_solve() */
+	int64_t start;                 /* Unix time of the first slot */
+	int slots;                     /* Slots until the car has to be ready, up to PLAN_SLOTS */
+	double kw;                     /* What the load draws when on */
+	double house_kw[PLAN_SLOTS];   /* Expected meter reading of each slot without the load; negative when sending to the grid */
+	double rate[PLAN_SLOTS];       /* $ per kWh from the grid */
+	double export_rate;            /* $ per kWh sent to the grid, which is what charging on the surplus costs */
+	double switch_cost;            /* $ for each switching, so the plan doesn't chatter */
+
+	/* Worked out by plan_solve() */
+	double cost[PLAN_SLOTS + 1][2];            /* Cost of the plan from the first slot, by slots needed and on before */
+	uint8_t on[PLAN_SLOTS][PLAN_SLOTS + 1][2]; /* Whether to charge, by slot, slots still needed and on before */
+};
+
+void plan_solve(struct plan *plan);
+int plan_on(const struct plan *plan, int64_t now, int needed, int was_on);
+
+/* Sample log: every cycle is recorded as one fixed-size binary record in a pre-sized ring file.
+   The file is a struct sample_log_header followed by 'capacity' records; once full, the oldest
+   record is overwritten. The file is mapped into memory so writing and reading cost no parsing. */
+#define SAMPLE_LOG_MAGIC "EVSAMPL1"
+#define SAMPLE_LOG_VERSION 1
+
+struct sample_log_header {
+	char magic[8];          /* SAMPLE_LOG_MAGIC */
+	uint32_t version;       /* SAMPLE_LOG_VERSION */
+	uint32_t record_size;   /* sizeof(struct sample_record) */
+	uint64_t capacity;      /* Number of records the file holds */
+	uint64_t count;         /* Number of records ever written; the next one goes at count % capacity */
+	uint8_t reserved[32];
+};
+
+/* Flags of a sample record */
+#define SAMPLE_PUSHED        0x01 /* The reading was pushed by the gateway instead of polled */
+#define SAMPLE_METER_FAILED  0x02 /* Could not read the meter; demand is not valid */
+#define SAMPLE_COMMAND_SENT  0x04 /* A command was sent to the switch */
+#define SAMPLE_SWITCH_FAILED 0x08 /* The switch command failed */
+
+struct sample_record {
+	int64_t time;           /* Unix time of the sample */
+	float demand;           /* Meter reading in kW; negative when exporting to the grid */
+	int8_t mode;            /* Mode of the EV charger after the decision (modes above) */
+	int8_t switch_result;   /* State the switch was set to: 1 = on, 0 = off, -1 = failed or not switched */
+	uint8_t flags;          /* SAMPLE_ flags */
+	uint8_t reserved;
+	uint32_t meter_ms;      /* Time taken to read the meter, 0 if pushed */
+	uint32_t switch_ms;     /* Time taken by the switch command(s) */
+	uint32_t cycle_ms;      /* Time taken by the whole cycle */
+	uint32_t loads_on;       /* Bit n set when load n (in the order of the load table) is on */
+};
+
+/* State export: at the end of every cycle ev-charger publishes each site's readings, modes and last switch
+   results into a POSIX shared-memory segment, so a dashboard or home-automation bridge on the same host can
+   map it read-only and read the state straight from memory. Each site's record has a sequence lock: the
+   control loop never waits for a reader, and a reader only copies the record again if it changed while being
+   copied (state_read()). The segment is a struct state_header followed by 'sites' records, 'site_size' bytes
+   apart, each a struct state_site with 'loads' struct state_load after it. A restarted ev-charger makes a new
+   segment, so a reader should map it again once the pid in the one it has is no longer running. */
+#define STATE_MAGIC "EVSTATE1"
+#define STATE_VERSION 1
+#define STATE_NAME_MAX 32
+
+struct state_header {
+	char magic[8];           /* STATE_MAGIC, set last once the rest is filled in */
+	uint32_t version;        /* STATE_VERSION */
+	uint32_t site_size;      /* Bytes from one site's record to the next */
+	uint32_t sites;
+	uint32_t loads;          /* Loads in each site's record */
+	int64_t started;         /* Unix time ev-charger started */
+	int32_t pid;             /* Of the ev-charger writing it */
+	uint8_t reserved[28];
+};
+
+struct state_load {
+	char name[STATE_NAME_MAX];
+	int32_t mode;            /* Mode of the load (modes above) */
+	int32_t switch_result;   /* What its switch was last set to: ON, OFF or -1 = failed */
+	int32_t amps;            /* Current setpoint of an EVSE; 0 = off or none */
+	uint32_t reserved;
+	int64_t changed;         /* Unix time it was last switched on or off */
+};
+
+struct state_site {
+	uint32_t seq;            /* Odd while the record is being written */
+	uint32_t flags;          /* SAMPLE_ flags of the last cycle */
+	char name[STATE_NAME_MAX]; /* As in the fleet file; "" when there is only the one site */
+	int64_t time;            /* Unix time of the last cycle; 0 = none yet */
+	int64_t reading_time;    /* Unix time of the last good meter reading */
+	double actual_demand;    /* Last meter reading in kW; negative when sending to the grid */
+	double house;            /* Smoothed reading without the loads */
+	int32_t value_charge;    /* 1 in the Value Charge time period */
+	int32_t switch_result;   /* As in the sample record: 1 = on, 0 = off, -1 = failed or not switched */
+	uint64_t cycles;
+	struct state_load loads[];
+};
+
+static inline int state_read(const struct state_header *h, uint32_t i, struct state_site *copy, size_t size) {
+
+	/* Copy (up to size bytes of) the record of site i, again if ev-charger was writing it at the time.
+	   Returns 0 if there is no such site. */
+
+	const struct state_site *s;
+	uint32_t before, after;
+
+	if (i >= h->sites) {
+		return 0;
+	}
+	if (size > h->site_size) {
+		size = h->site_size;
+	}
+	s = (const struct state_site *)((const char *)(h + 1) + (size_t)i * h->site_size);
+	do {
+		before = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		memcpy(copy, s, size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE); // The copy is done before the count is checked
+		after = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+	} while ((before & 1) || before != after);
+	return 1;
+}
+
+#endif
@@ -0,0 +1,320 @@
+/*****************************************************************************
+ *                                                                           *
+ * Copyright (C) 2016-2021, Greg Stevens, <greg@e-ctrl.com>                  *
+ *                                                                           *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell  *
+ * copies of this Software, and permit persons to whom this Software is      *
+ * furnished to do so.                                                       *
+ *                                                                           *
+ * This Software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY *
+ * KIND, either expressed or implied.                                        *
+ *                                                                           *
+ *****************************************************************************
+
+Description:
+
+	The on/off decision for the switched loads, shared by ev-charger and ev-replay. Given the meter
+	reading, the time and the loads' current state it says which loads should be on, and given how
+	the switching went it works out each load's new mode and the event to report. The readings are
+	smoothed here too, with hysteresis on the decision, so clouds don't chatter the switches, and the
+	energy in and out between readings is worked out from the meter's registers. For a load that
+	takes a current setpoint (an EVSE) the setpoint is moved to follow the surplus. Nothing here does
+	I/O or looks at the clock, so a recorded year of readings can be run through it in well under a
+	second.
+
+	Compiled in with ev-charger.c, ev-replay.c and ev-charger-lite.c; see their command lines.
+
+*/
+
+/* Include the needed libraries */
+#include "ev-charger.h"
+
+#define ALLOCATION_STEP_KW 0.05   /* Resolution the surplus is shared out at */
+#ifndef SURPLUS_STEPS
+#define SURPLUS_STEPS 2000        /* Largest surplus that is shared out, in steps (100 kW); anything bigger is treated as this */
+#endif
+#ifndef DECIDE_LOADS
+#define DECIDE_LOADS MAX_LOADS    /* Most loads decide() is given; a build with fewer sets less to keep the work tables small */
+#endif
+
+double decide(const struct decide_config *config, struct decide_load *const loads[], int n, double demand, int value_charge, int64_t now, int want[]) {
+
+	/* Decide which loads should be on, setting want[] for each one. The loads that are on now are taken
+	   out of the meter reading to get what the house alone draws; the surplus left for the loads is then
+	   the threshold minus that. Loads held by the charge plan or by their minimum on/off time, and value
+	   charge loads during the Value Charge time period, are fixed; the rest are shared out with a knapsack over the surplus in
+	   ALLOCATION_STEP_KW steps, maximizing the priority-weighted kilowatts used. For the hysteresis a free
+	   load that is off needs on_band kW more than it draws and one that is on off_band kW less. With a
+	   single load this is the same comparison as turning it on when house + load + on_band <= threshold
+	   and keeping it on while house + load - off_band <= threshold.
+
+	   Returns how many kilowatts the reading would have to change by to change the decision. The work
+	   tables are static, so only one thread may decide at a time. */
+
+	static double best[SURPLUS_STEPS + 1];
+	static unsigned char take[DECIDE_LOADS][SURPLUS_STEPS + 1];
+	int steps[MAX_LOADS];
+	double need[MAX_LOADS];
+	int free_loads[MAX_LOADS];
+	int nfree = 0;
+	int needed = 0;
+	double surplus = config->threshold - demand;
+
+	for (int i = 0; i < n; i++) {
+		const struct decide_load *l = loads[i];
+		int on = l->mode != OFF;
+
+		if (on) {
+			surplus += decide_draw(l); // What the house draws without this load
+		}
+		if (l->held) {
+			want[i] = l->held > 0; // The charge plan has it
+		} else if (value_charge && l->value_charge) {
+			want[i] = 1;
+		} else if (on && now - l->changed < l->min_on_seconds) {
+			want[i] = 1;
+		} else if (!on && now - l->changed < l->min_off_seconds) {
+			want[i] = 0;
+		} else {
+			want[i] = 0;
+			free_loads[nfree++] = i;
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		if (want[i]) {
+			surplus -= loads[i]->kw; // Fixed on, so it uses up part of the surplus
+		}
+	}
+
+	/* Share out what is left */
+	int capacity = surplus > 0 ? (int)(surplus / ALLOCATION_STEP_KW + 1e-6) : 0;
+	if (capacity > SURPLUS_STEPS) {
+		capacity = SURPLUS_STEPS;
+	}
+	for (int f = 0; f < nfree; f++) {
+		const struct decide_load *l = loads[free_loads[f]];
+		need[f] = l->kw + (l->mode != OFF ? -config->off_band : config->on_band);
+		if (need[f] < 0) {
+			need[f] = 0;
+		}
+		steps[f] = (int)(need[f] / ALLOCATION_STEP_KW + 0.5);
+		needed += steps[f];
+	}
+	if (needed <= capacity) {
+		/* Enough for all of them, which is the usual case with one or two loads */
+		for (int f = 0; f < nfree; f++) {
+			want[free_loads[f]] = 1;
+			surplus -= need[f];
+		}
+	} else {
+		for (int c = 0; c <= capacity; c++) {
+			best[c] = 0;
+		}
+		for (int f = 0; f < nfree; f++) {
+			const struct decide_load *l = loads[free_loads[f]];
+			for (int c = capacity; c >= 0; c--) {
+				take[f][c] = 0;
+				if (steps[f] <= c && best[c - steps[f]] + l->kw * l->priority > best[c]) {
+					best[c] = best[c - steps[f]] + l->kw * l->priority;
+					take[f][c] = 1;
+				}
+			}
+		}
+		for (int f = nfree - 1, c = capacity; f >= 0; f--) {
+			if (take[f][c]) {
+				want[free_loads[f]] = 1;
+				c -= steps[f];
+				surplus -= need[f];
+			}
+		}
+	}
+
+	/* The decision changes when the surplus left drops below zero, or grows enough for a load still off */
+	double margin = 1e9;
+	for (int f = 0; f < nfree; f++) {
+		double m = want[free_loads[f]] ? surplus : need[f] - surplus;
+		if (m < 0) {
+			m = -m;
+		}
+		if (m < margin) {
+			margin = m;
+		}
+	}
+	return margin;
+}
+
+int decide_avoided(const struct decide_config *config, struct decide_load *const loads[], int n, double demand, int value_charge, int64_t now, const int want[]) {
+
+	/* Count the switchings the smoothing saved: decide again on the raw meter reading with no hysteresis
+	   and no minimum on/off times, and return how many loads that newly wants switched which want[]
+	   (the decision actually taken) leaves as they are. A load held off over several readings counts once. */
+
+	struct decide_config raw = { config->threshold, 0, 0 };
+	struct decide_load copies[MAX_LOADS];
+	struct decide_load *bare[MAX_LOADS] = { 0 };
+	int raw_want[MAX_LOADS];
+	int avoided = 0;
+
+	for (int i = 0; i < n; i++) {
+		copies[i] = *loads[i];
+		copies[i].min_on_seconds = copies[i].min_off_seconds = 0;
+		bare[i] = &copies[i];
+	}
+	decide(&raw, bare, n, demand, value_charge, now, raw_want);
+	for (int i = 0; i < n; i++) {
+		int on = loads[i]->mode != OFF;
+		if (raw_want[i] != on && want[i] == on && raw_want[i] != loads[i]->raw_want) {
+			avoided++;
+		}
+		loads[i]->raw_want = raw_want[i];
+	}
+	return avoided;
+}
+
+double demand_filter_add(struct demand_filter *f, struct decide_load *const loads[], int n, double demand, int64_t now) {
+
+	/* Add a meter reading to the filter and return the smoothed reading to decide on. The loads that are on
+	   (as they were while the reading was taken) come out of it first and go back into what is returned, so
+	   switching them isn't smoothed over. The moving average weighs a reading by the time since the last
+	   one, dt / (tau + dt), so a long gap between readings counts for more. */
+
+	double loads_kw = 0;
+	float window[DEMAND_WINDOW];
+	int median = f->median < 1 ? 1 : f->median > DEMAND_WINDOW ? DEMAND_WINDOW : f->median;
+	int count;
+
+	for (int i = 0; i < n; i++) {
+		if (loads[i]->mode != OFF) {
+			loads_kw += decide_draw(loads[i]);
+		}
+	}
+	f->recent[f->next] = demand - loads_kw;
+	f->next = (f->next + 1) % DEMAND_WINDOW;
+	if (f->count < DEMAND_WINDOW) {
+		f->count++;
+	}
+
+	/* Median of the last few, sorted in a copy */
+	count = f->count < median ? f->count : median;
+	for (int i = 0; i < count; i++) {
+		float v = f->recent[(f->next - 1 - i + DEMAND_WINDOW) % DEMAND_WINDOW];
+		int j = i;
+		while (j > 0 && window[j - 1] > v) {
+			window[j] = window[j - 1];
+			j--;
+		}
+		window[j] = v;
+	}
+	double house = count % 2 ? window[count / 2] : (window[count / 2 - 1] + window[count / 2]) / 2;
+
+	if (f->count == 1 || f->tau_seconds <= 0) {
+		f->house = house;
+	} else if (now > f->time) {
+		double dt = now - f->time;
+		f->house += (house - f->house) * dt / (f->tau_seconds + dt);
+	}
+	f->time = now;
+	return f->house + loads_kw;
+}
+
+int decide_target(const struct decide_load *load, int want, int value_charge) {
+
+	/* The mode the load should end up in: ON_VC, ON or OFF */
+
+	if (want && value_charge && load->value_charge) {
+		return ON_VC;
+	}
+	return want ? ON : OFF;
+}
+
+int decide_apply(struct decide_load *load, int target, int result, int64_t now) {
+
+	/* The load's switch has been set towards the target mode; result is what the switch returned
+	   (ON, OFF or -1 for failed). Updates the load's mode and returns the event to report (ON, ON_VC,
+	   OFF_CURRENT, OFF_VALUE or one of the errors), or -1 if there is nothing to report. */
+
+	int event = -1;
+
+	if (target == ON_VC) {
+		/* In the Value Charge time frame, so the switch was turned on */
+		if (result != ON) {
+			return ON_VC_ERROR;
+		}
+		if (load->mode == OFF) {
+			event = ON_VC;
+			load->changed = now;
+		}
+		load->mode = ON_VC; // Set to indicate on during the Value Charge period
+	} else if (target == ON) {
+		if (result != ON) {
+			return ON_ERROR;
+		}
+		if (load->mode == OFF) {
+			event = ON;
+			load->changed = now;
+		}
+		load->mode = ON; // Set state to on
+	} else {
+		if (result != OFF) {
+			return OFF_ERROR;
+		}
+		if (load->mode == ON_VC) {
+			event = OFF_VALUE;
+		} else if (load->mode == ON) {
+			event = OFF_CURRENT;
+		}
+		if (load->mode != OFF) {
+			load->changed = now;
+		}
+		load->mode = OFF; // Set state to off
+	}
+	return event;
+}
+
+int current_control_next(struct current_control *c, double available_kw, int full) {
+
+	/* The setpoint for a load that is on, given the kW it can draw without taking from the grid (what it
+	   draws now plus what the meter says is left), or its most if full (cheap energy from the grid). It is
+	   in whole amps from min_amps to max_amps. Going up it moves at most step_amps a reading, so a passing
+	   gap in the clouds doesn't swing it to the top; going down it moves at once. */
+
+	int target = available_kw > 0 && c->volts > 0 ? (int)(available_kw * 1000 / c->volts) : 0;
+	int from = c->amps > 0 ? c->amps : c->min_amps;
+
+	if (full || target > c->max_amps) {
+		target = c->max_amps;
+	}
+	if (target < c->min_amps) {
+		target = c->min_amps;
+	}
+	if (c->step_amps > 0 && target > from + c->step_amps) {
+		target = from + c->step_amps;
+	}
+	c->amps = target;
+	return target;
+}
+
+int energy_account_add(struct energy_account *a, double delivered, double received, int64_t now) {
+
+	/* Account for the energy since the last reading from the registers at this one. Returns 1 if the
+	   interval's figures were updated, 0 if this reading only starts the accounting. */
+
+	double imported = delivered - a->delivered;
+	double exported = received - a->received;
+	int counted = a->have && now > a->time && imported >= 0 && exported >= 0;
+
+	if (counted) {
+		a->interval_hours = (now - a->time) / 3600.0;
+		a->net_export_kwh = exported - imported;
+		a->net_export_kw = a->net_export_kwh / a->interval_hours;
+		a->imported_kwh += imported;
+		a->exported_kwh += exported;
+	}
+	if (counted || !a->have || now > a->time) {
+		a->delivered = delivered;
+		a->received = received;
+		a->time = now;
+		a->have = 1;
+	}
+	return counted;
+}
@@ -0,0 +1,162 @@
+/*****************************************************************************
+ *                                                                           *
+ * Copyright (C) 2016-2021, Greg Stevens, <greg@e-ctrl.com>                  *
+ *                                                                           *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell  *
+ * copies of this Software, and permit persons to whom this Software is      *
+ * furnished to do so.                                                       *
+ *                                                                           *
+ * This Software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY *
+ * KIND, either expressed or implied.                                        *
+ *                                                                           *
+ *****************************************************************************
+
+Description:
+
+	The parser of the Eagle-200's XML, shared by ev-charger and ev-charger-lite. It picks the meter's
+	Hardware Address out of a device_list, the demand and summation registers out of a device_query,
+	and the raw registers out of the messages the gateway pushes. It is fed the response a piece at a
+	time as it comes in and keeps only the current tag and text, so it needs no buffer and no
+	allocation whatever the size of the response.
+
+	Compiled in with ev-charger.c and ev-charger-lite.c; see their command lines.
+
+*/
+
+/* Include the needed libraries */
+#include <stdlib.h>
+#include <string.h>
+#include "ev-charger.h"
+
+/* The POST body to read the hardware address of the meter */
+const char *const ha_post_body = "<Command><Name>device_list</Name></Command>";
+
+/* The POST body to read the InstantaneousDemand of the meter */
+const char *const meter_post_body_pre = "<Command><Name>device_query</Name><DeviceDetails><HardwareAddress>";
+const char *const meter_post_body_suf = "</HardwareAddress></DeviceDetails><Components><Component><Name>Main</Name><Variables>"
+	"<Variable><Name>zigbee:InstantaneousDemand</Name></Variable>"
+	"<Variable><Name>zigbee:CurrentSummationDelivered</Name></Variable>"    // The registers come in the same request,
+	"<Variable><Name>zigbee:CurrentSummationReceived</Name></Variable>"     // see struct energy_account
+	"<Variable><Name>zigbee:Multiplier</Name></Variable><Variable><Name>zigbee:Divisor</Name></Variable>"
+	"</Variables></Component></Components></Command>";
+
+void eagle_parse_reset(struct eagle_parse *p) {
+
+	/* Get ready for a new POST Response */
+
+	memset(p, 0, sizeof(*p));
+	p->multiplier = 1;
+	p->divisor = 1;
+}
+
+static void eagle_parse_element(struct eagle_parse *p) {
+
+	/* Called at the end of each element with its tag name in p->tag and its text in p->text */
+
+	if (!strcmp(p->tag, "Name")) {
+		memcpy(p->name, p->text, sizeof(p->name)); // Name of the variable whose <Value> comes next
+	} else if (!strcmp(p->tag, "Value")) {
+		if (!strcmp(p->name, "zigbee:InstantaneousDemand")) {
+			p->demand = atof(p->text);
+			p->have_demand = 1;
+		} else if (!strcmp(p->name, "zigbee:CurrentSummationDelivered")) {
+			p->delivered = strtod(p->text, NULL);
+			p->raw_summation |= !strncmp(p->text, "0x", 2);
+			p->summation |= 1;
+		} else if (!strcmp(p->name, "zigbee:CurrentSummationReceived")) {
+			p->received = strtod(p->text, NULL);
+			p->raw_summation |= !strncmp(p->text, "0x", 2);
+			p->summation |= 2;
+		} else if (!strcmp(p->name, "zigbee:Multiplier")) {
+			p->multiplier = atof(p->text);
+		} else if (!strcmp(p->name, "zigbee:Divisor")) {
+			p->divisor = atof(p->text);
+		}
+	} else if (!strcmp(p->tag, "Multiplier")) {
+		p->multiplier = strtol(p->text, NULL, 0);
+	} else if (!strcmp(p->tag, "Divisor")) {
+		p->divisor = strtol(p->text, NULL, 0);
+	} else if (!strcmp(p->tag, "Demand")) {
+		p->raw_demand = (int)strtoul(p->text, NULL, 0); // Signed value sent as hex
+		p->have_raw_demand = 1;
+	} else if (!strcmp(p->tag, "InstantaneousDemand") && p->have_raw_demand) {
+		/* Pushed messages carry the raw register value; scale it to kW */
+		p->demand = p->raw_demand * p->multiplier / (p->divisor ? p->divisor : 1);
+		p->have_demand = 1;
+	} else if (!strcmp(p->tag, "SummationDelivered")) {
+		p->delivered = strtoull(p->text, NULL, 0); // Pushed <CurrentSummation> messages have the raw registers
+		p->raw_summation = 1;
+		p->summation |= 1;
+	} else if (!strcmp(p->tag, "SummationReceived")) {
+		p->received = strtoull(p->text, NULL, 0);
+		p->raw_summation = 1;
+		p->summation |= 2;
+	} else if (!strcmp(p->tag, "HardwareAddress")) {
+		memcpy(p->device_address, p->text, sizeof(p->device_address) - 1);
+	} else if (!strcmp(p->tag, "MeterMacId")) {
+		memcpy(p->hardware_address, p->text, sizeof(p->hardware_address) - 1); // Which meter a pushed message is from
+		p->have_address = 1;
+	} else if (!strcmp(p->tag, "ModelId")) {
+		memcpy(p->model, p->text, sizeof(p->model));
+	} else if (!strcmp(p->tag, "Device") || !strcmp(p->tag, "DeviceDetails")) {
+		/* A device_list can have several paired devices; take the electric meter, else the first one */
+		if (p->device_address[0] && (!p->have_address || !strcmp(p->model, "electric_meter"))) {
+			memcpy(p->hardware_address, p->device_address, sizeof(p->hardware_address));
+			p->have_address = 1;
+		}
+		p->device_address[0] = '\0';
+		p->model[0] = '\0';
+	}
+}
+
+void eagle_parse_feed(struct eagle_parse *p, const char *data, size_t len) {
+
+	/* Scan the next piece of the POST Response. Only the current tag name and element text are
+	   kept (truncated to XML_TOKEN_MAX), so any response size parses in one pass with fixed memory,
+	   and a tag or value split across pieces is picked up where the last piece left off. */
+
+	for (size_t i = 0; i < len; i++) {
+		char c = data[i];
+
+		if (p->in_tag) {
+			if (c == '>') {
+				p->tag[p->tag_len] = '\0';
+				if (p->closing) {
+					p->text[p->text_len] = '\0';
+					eagle_parse_element(p);
+				}
+				p->in_tag = 0;
+				p->text_len = 0;
+			} else if (p->tag_len == 0 && !p->closing && c == '/') {
+				p->closing = 1;
+			} else if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '/') {
+				p->tag_done = 1; // Rest of the tag is attributes
+			} else if (!p->tag_done && p->tag_len < XML_TOKEN_MAX - 1) {
+				p->tag[p->tag_len++] = c;
+			}
+		} else if (c == '<') {
+			p->in_tag = 1;
+			p->closing = 0;
+			p->tag_done = 0;
+			p->tag_len = 0;
+		} else if (p->text_len < XML_TOKEN_MAX - 1) {
+			p->text[p->text_len++] = c;
+		}
+	}
+	p->bytes += len;
+}
+
+int eagle_parse_summation(const struct eagle_parse *p, double *delivered, double *received) {
+
+	/* The summation registers in kWh, if the response had both. The multiplier and divisor can come after
+	   the registers, so raw values are only scaled once the whole response is in. */
+
+	double scale = p->raw_summation ? p->multiplier / (p->divisor ? p->divisor : 1) : 1;
+
+	if (p->summation != 3) {
+		return 0;
+	}
+	*delivered = p->delivered * scale;
+	*received = p->received * scale;
+	return 1;
+}
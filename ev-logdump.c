@@ -0,0 +1,145 @@
+/*****************************************************************************
+ *                                                                           *
+ * Copyright (C) 2016-2021, Greg Stevens, <greg@e-ctrl.com>                  *
+ *                                                                           *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell  *
+ * copies of this Software, and permit persons to whom this Software is      *
+ * furnished to do so.                                                       *
+ *                                                                           *
+ * This Software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY *
+ * KIND, either expressed or implied.                                        *
+ *                                                                           *
+ *****************************************************************************
+
+Description:
+
+	Dumps the samples recorded by ev-charger in its sample log, optionally only those in a time range.
+	The log is mapped read-only, so it can be dumped while ev-charger is running.
+
+	ev-logdump <sample log> [from [to]]
+
+	from and to are either Unix times or local times as YYYY-MM-DD or YYYY-MM-DDTHH:MM[:SS].
+
+Use GNU toolchain; command line to compile:
+gcc -Wall -ggdb3 ev-logdump.c -oev-logdump.exe
+
+*/
+
+/* Include the needed libraries */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ev-charger.h"
+
+static const char *mode_names[] = { /* By the modes in ev-charger.h */
+   [OFF] = "OFF",
+   [ON] = "ON",
+   [ON_ERROR] = "ON_ERROR",
+   [OFF_ERROR] = "OFF_ERROR",
+   [ON_VC] = "ON_VC",
+   [ON_VC_ERROR] = "ON_VC_ERROR",
+   [OFF_CURRENT] = "OFF_CURRENT",
+   [OFF_VALUE] = "OFF_VALUE",
+   [ON_STARTUP] = "ON_STARTUP",
+};
+
+static int parse_time(const char *text, time_t *t) {
+
+	/* Convert a Unix time or a local YYYY-MM-DD[THH:MM[:SS]] time. Returns 1 on success. */
+
+	struct tm tm;
+	char *end;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(text, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) == 3) {
+		const char *clock = strchr(text, 'T');
+		if (!clock) {
+			clock = strchr(text, ' ');
+		}
+		if (clock && sscanf(clock + 1, "%d:%d:%d", &tm.tm_hour, &tm.tm_min, &tm.tm_sec) < 2) {
+			return 0;
+		}
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		tm.tm_isdst = -1;
+		*t = mktime(&tm);
+		return *t != (time_t)-1;
+	}
+	*t = strtoll(text, &end, 10);
+	return *text && !*end;
+}
+
+int main(int argc, char *argv[]) {
+
+	struct stat st;
+	time_t from = 0, to = (time_t)INT64_MAX;
+
+	if (argc < 2 || argc > 4 || (argc > 2 && !parse_time(argv[2], &from)) || (argc > 3 && !parse_time(argv[3], &to))) {
+		fprintf(stderr, "Usage: %s <sample log> [from [to]]\n"
+		                "from and to are Unix times or local times as YYYY-MM-DD or YYYY-MM-DDTHH:MM[:SS]\n", argv[0]);
+		return 2;
+	}
+
+	int fd = open(argv[1], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	if ((size_t)st.st_size < sizeof(struct sample_log_header)) {
+		fprintf(stderr, "%s: not a sample log\n", argv[1]);
+		return 1;
+	}
+	const struct sample_log_header *header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (memcmp(header->magic, SAMPLE_LOG_MAGIC, sizeof(header->magic)) || header->version != SAMPLE_LOG_VERSION ||
+	    header->record_size != sizeof(struct sample_record) || header->capacity == 0 ||
+	    (uint64_t)st.st_size < sizeof(*header) + header->capacity * sizeof(struct sample_record)) {
+		fprintf(stderr, "%s: not a sample log, or from a different version of ev-charger\n", argv[1]);
+		return 1;
+	}
+	const struct sample_record *records = (const struct sample_record *)(header + 1);
+
+	/* Records are numbered from the oldest one still in the log; record n is at index n % capacity */
+	uint64_t count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+	uint64_t first = count > header->capacity ? count - header->capacity : 0;
+
+	/* Samples are in time order, so binary search for the first one in the range */
+	uint64_t lo = first, hi = count;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (records[mid % header->capacity].time < from) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	printf("%-19s %9s %-11s %6s %9s %9s %9s %8s %s\n", "time", "kW", "mode", "switch", "meter_ms", "switch_ms", "cycle_ms", "loads", "flags");
+	for (uint64_t n = lo; n < count; n++) {
+		const struct sample_record *r = &records[n % header->capacity];
+		char when[20];
+		time_t t = r->time;
+
+		if (t > to) {
+			break;
+		}
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+		printf("%-19s %9.3f %-11s %6s %9u %9u %9u %08x %s%s%s%s\n", when, r->demand,
+		       (r->mode >= 0 && r->mode < (int)(sizeof(mode_names) / sizeof(mode_names[0])) && mode_names[r->mode]) ? mode_names[r->mode] : "?",
+		       r->switch_result == 1 ? "on" : r->switch_result == 0 ? "off" : "-",
+		       r->meter_ms, r->switch_ms, r->cycle_ms, r->loads_on,
+		       (r->flags & SAMPLE_PUSHED) ? "pushed " : "",
+		       (r->flags & SAMPLE_METER_FAILED) ? "meter-failed " : "",
+		       (r->flags & SAMPLE_COMMAND_SENT) ? "command-sent " : "",
+		       (r->flags & SAMPLE_SWITCH_FAILED) ? "switch-failed" : "");
+	}
+	return 0;
+}
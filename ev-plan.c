@@ -0,0 +1,89 @@
+/*****************************************************************************
+ *                                                                           *
+ * Copyright (C) 2016-2021, Greg Stevens, <greg@e-ctrl.com>                  *
+ *                                                                           *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell  *
+ * copies of this Software, and permit persons to whom this Software is      *
+ * furnished to do so.                                                       *
+ *                                                                           *
+ * This Software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY *
+ * KIND, either expressed or implied.                                        *
+ *                                                                           *
+ *****************************************************************************
+
+Description:
+
+	The day-ahead charge plan for ev-charger. Given the expected meter reading of each 15 minute slot
+	until the car has to be ready (the house less the solar forecast) and the tariff, a dynamic
+	program over the slots finds the cheapest on/off schedule that gets the charging needed. Charging
+	on the surplus costs what sending it to the grid would have earned, charging on the grid costs
+	the slot's rate, and each switching costs a little so the plan keeps to long runs.
+
+	The program is solved backwards from the end for every amount of charging still needed, so the
+	table it leaves says what to do in any slot whatever has been charged by then; a slot missed or a
+	switch that failed needs no solving again, only a forecast that changes does. Like ev-decide.c it
+	does no I/O and doesn't look at the clock.
+
+	Compiled in with ev-charger.c; see its command line.
+
+*/
+
+/* Include the needed libraries */
+#include <string.h>
+#include "ev-charger.h"
+
+static double plan_slot_cost(const struct plan *plan, int t) {
+
+	/* What charging in the slot costs: the part the surplus covers at the export rate, the rest at the tier's rate */
+
+	double surplus = plan->house_kw[t] < 0 ? -plan->house_kw[t] : 0;
+	double solar = surplus < plan->kw ? surplus : plan->kw;
+
+	return (solar * plan->export_rate + (plan->kw - solar) * plan->rate[t]) * PLAN_SLOT_SECONDS / 3600.0;
+}
+
+void plan_solve(struct plan *plan) {
+
+	/* Fill in plan->on[][][] and plan->cost[][], working back from the end of the last slot, where each
+	   slot of charging still needed costs PLAN_SHORTFALL_COST. With k slots still needed and the load on
+	   in the slot before or not, a slot either charges, for its cost and one slot nearer, or doesn't;
+	   switching either way costs switch_cost. */
+
+	double next[PLAN_SLOTS + 1][2];
+	int slots = plan->slots < 0 ? 0 : plan->slots > PLAN_SLOTS ? PLAN_SLOTS : plan->slots;
+
+	plan->slots = slots;
+	for (int k = 0; k <= PLAN_SLOTS; k++) {
+		plan->cost[k][0] = plan->cost[k][1] = k * (double)PLAN_SHORTFALL_COST;
+	}
+	for (int t = slots - 1; t >= 0; t--) {
+		double charge = plan_slot_cost(plan, t);
+
+		memcpy(next, plan->cost, sizeof(next)); // From slot t + 1 on
+		for (int k = 0; k <= PLAN_SLOTS; k++) {
+			for (int was_on = 0; was_on < 2; was_on++) {
+				double off = next[k][0] + (was_on ? plan->switch_cost : 0);
+				double on = k > 0 ? charge + next[k - 1][1] + (was_on ? 0 : plan->switch_cost) : off + 1;
+
+				plan->on[t][k][was_on] = on < off;
+				plan->cost[k][was_on] = on < off ? on : off;
+			}
+		}
+	}
+}
+
+int plan_on(const struct plan *plan, int64_t now, int needed, int was_on) {
+
+	/* Whether the plan has the load on at the time, with this many slots of charging still needed, or -1
+	   if the time isn't in the plan */
+
+	int64_t t = now < plan->start ? -1 : (now - plan->start) / PLAN_SLOT_SECONDS;
+
+	if (t < 0 || t >= plan->slots) {
+		return -1;
+	}
+	if (needed > PLAN_SLOTS) {
+		needed = PLAN_SLOTS;
+	}
+	return needed > 0 && plan->on[t][needed][was_on != 0];
+}
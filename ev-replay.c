@@ -0,0 +1,227 @@
+/*****************************************************************************
+ *                                                                           *
+ * Copyright (C) 2016-2021, Greg Stevens, <greg@e-ctrl.com>                  *
+ *                                                                           *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell  *
+ * copies of this Software, and permit persons to whom this Software is      *
+ * furnished to do so.                                                       *
+ *                                                                           *
+ * This Software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY *
+ * KIND, either expressed or implied.                                        *
+ *                                                                           *
+ *****************************************************************************
+
+Description:
+
+	Replays the meter readings recorded by ev-charger in its sample log through the same switching
+	decision (ev-decide.c) with other settings, to see what they would have done without waiting for
+	days of sun. For each setting it prints how many times the EV charger would have been switched,
+	the energy drawn from and sent to the grid, the energy that went into the EV and what it all cost
+	on the time-of-use plan in ev-tariff.c (energy sent to the grid is credited at the same rates).
+	The readings are smoothed and the hysteresis applied as in ev-charger, and the switchings that
+	saved are counted too.
+
+	ev-replay <sample log> [threshold[:to:step] [kW[:to:step]]]
+
+	threshold is SWITCHING_THRESHOLD and kW is EV_CHARGING_CURRENT; give a range to sweep them. What the
+	house drew is worked out from each reading by taking out the EV charger if it was on at the time,
+	using RECORDED_KW as what it drew.
+
+Use GNU toolchain; command line to compile:
+gcc -Wall -O2 ev-replay.c ev-decide.c ev-tariff.c -oev-replay.exe
+
+*/
+
+/* Include the needed libraries */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ev-charger.h"
+
+/* Define constants used; keep these the same as in ev-charger.c */
+#define SWITCHING_THRESHOLD 0      /* Default threshold to replay */
+#define EV_CHARGING_CURRENT 1.4    /* Default kW of the EV charger to replay */
+#define RECORDED_KW 1.4            /* kW the EV charger drew when the log was recorded */
+#define MAX_GAP_SECONDS 3600       /* A gap between readings longer than this (ev-charger not running) is not counted */
+#define DEMAND_MEDIAN_READINGS 3
+#define DEMAND_TAU_SECONDS 180
+#define SWITCHING_ON_BAND 0.2
+#define SWITCHING_OFF_BAND 0.2
+
+struct replay_sample {
+	int64_t time;
+	float house;                   /* kW the house drew without the EV charger */
+	float hours;                   /* Time until the next reading, in hours */
+	float rate;                    /* $ per kWh */
+	int8_t value_charge;           /* In the Value Charge time period */
+};
+
+struct replay_result {
+	unsigned long switches;        /* Times the charger was turned on or off */
+	unsigned long avoided;         /* Times the raw reading would have switched it but the smoothing didn't */
+	double imported_kwh;           /* Drawn from the grid */
+	double exported_kwh;           /* Sent to the grid */
+	double ev_kwh;                 /* Went into the EV */
+	double cost;                   /* Net cost of the energy from the grid */
+};
+
+static int parse_range(const char *text, double *from, double *to, double *step) {
+
+	/* Read a value or a from:to:step range. Returns 1 on success. */
+
+	int n = sscanf(text, "%lf:%lf:%lf", from, to, step);
+
+	if (n == 1) {
+		*to = *from;
+		*step = 1;
+		return 1;
+	}
+	return n == 3 && *step > 0;
+}
+
+static void replay(const struct replay_sample *samples, size_t n, double threshold, double kw, struct replay_result *r) {
+
+	/* Run the readings through the decision with these settings, as ev-charger would have at each one.
+	   Every switch command is taken to have worked. */
+
+	struct decide_config config = { threshold, SWITCHING_ON_BAND, SWITCHING_OFF_BAND };
+	struct demand_filter smoothing = { DEMAND_MEDIAN_READINGS, DEMAND_TAU_SECONDS };
+	struct decide_load ev = { .kw = kw, .priority = 1, .value_charge = 1, .mode = ON_STARTUP };
+	struct decide_load *loads[1] = { &ev };
+	int want[1];
+
+	memset(r, 0, sizeof(*r));
+	for (size_t i = 0; i < n; i++) {
+		const struct replay_sample *s = &samples[i];
+		int was_on = ev.mode != OFF;
+		int value_charge = s->value_charge;
+
+		double demand = s->house + (was_on ? kw : 0);
+
+		decide(&config, loads, 1, demand_filter_add(&smoothing, loads, 1, demand, s->time), value_charge, s->time, want);
+		r->avoided += decide_avoided(&config, loads, 1, demand, value_charge, s->time, want);
+		int target = decide_target(&ev, want[0], value_charge);
+		decide_apply(&ev, target, target == OFF ? OFF : ON, s->time);
+
+		int on = ev.mode != OFF;
+		if (on != was_on) {
+			r->switches++;
+		}
+
+		/* Until the next reading the house is taken to draw the same */
+		double grid = s->house + (on ? kw : 0);
+		double kwh = grid * s->hours;
+		if (kwh > 0) {
+			r->imported_kwh += kwh;
+		} else {
+			r->exported_kwh -= kwh;
+		}
+		if (on) {
+			r->ev_kwh += kw * s->hours;
+		}
+		r->cost += kwh * s->rate;
+	}
+}
+
+int main(int argc, char *argv[]) {
+
+	struct stat st;
+	double threshold = SWITCHING_THRESHOLD, threshold_to = SWITCHING_THRESHOLD, threshold_step = 1;
+	double kw = EV_CHARGING_CURRENT, kw_to = EV_CHARGING_CURRENT, kw_step = 1;
+
+	if (argc < 2 || argc > 4 || (argc > 2 && !parse_range(argv[2], &threshold, &threshold_to, &threshold_step)) ||
+	    (argc > 3 && !parse_range(argv[3], &kw, &kw_to, &kw_step))) {
+		fprintf(stderr, "Usage: %s <sample log> [threshold[:to:step] [kW[:to:step]]]\n", argv[0]);
+		return 2;
+	}
+
+	int fd = open(argv[1], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	if ((size_t)st.st_size < sizeof(struct sample_log_header)) {
+		fprintf(stderr, "%s: not a sample log\n", argv[1]);
+		return 1;
+	}
+	const struct sample_log_header *header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (memcmp(header->magic, SAMPLE_LOG_MAGIC, sizeof(header->magic)) || header->version != SAMPLE_LOG_VERSION ||
+	    header->record_size != sizeof(struct sample_record) || header->capacity == 0 ||
+	    (uint64_t)st.st_size < sizeof(*header) + header->capacity * sizeof(struct sample_record)) {
+		fprintf(stderr, "%s: not a sample log, or from a different version of ev-charger\n", argv[1]);
+		return 1;
+	}
+	const struct sample_record *records = (const struct sample_record *)(header + 1);
+	uint64_t count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+	uint64_t first = count > header->capacity ? count - header->capacity : 0;
+
+	/* Work out what doesn't depend on the settings once: what the house drew, the tier and the time to the
+	   next reading. The EV charger's mode in a record is after that cycle's decision, so whether it was
+	   drawing during a reading comes from the record before. */
+	struct replay_sample *samples = malloc((count - first + 1) * sizeof(*samples));
+	size_t n = 0;
+	int was_on = 0;
+	struct tariff_table *tariffs = malloc(sizeof(*tariffs));
+
+	if (!samples || !tariffs) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	for (uint64_t i = first; i < count; i++) {
+		const struct sample_record *r = &records[i % header->capacity];
+		int on = r->mode == ON || r->mode == ON_VC || r->mode == ON_STARTUP;
+
+		if (!(r->flags & SAMPLE_METER_FAILED)) {
+			const struct tariff_tier *tier;
+			if (n == 0) {
+				tariff_compile(tariffs, &tariff_plan, r->time);
+			}
+			tier = tariff_at(tariffs, r->time);
+			if (n > 0) {
+				int64_t gap = r->time - samples[n - 1].time;
+				samples[n - 1].hours = gap > 0 && gap <= MAX_GAP_SECONDS ? gap / 3600.0 : 0;
+			}
+			samples[n].time = r->time;
+			samples[n].house = r->demand - (was_on ? RECORDED_KW : 0);
+			samples[n].hours = 0;
+			samples[n].rate = tier->rate;
+			samples[n].value_charge = tier->value_charge;
+			n++;
+		}
+		was_on = on;
+	}
+	if (n == 0) {
+		fprintf(stderr, "%s: no readings to replay\n", argv[1]);
+		return 1;
+	}
+
+	struct timespec start, end;
+	unsigned long runs = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	printf("%9s %6s %8s %8s %12s %12s %12s %10s\n", "threshold", "kW", "switches", "avoided", "import_kWh", "export_kWh", "ev_kWh", "cost");
+	for (double t = threshold; t <= threshold_to + 1e-9; t += threshold_step) {
+		for (double k = kw; k <= kw_to + 1e-9; k += kw_step) {
+			struct replay_result r;
+			replay(samples, n, t, k, &r);
+			printf("%9.3f %6.3f %8lu %8lu %12.3f %12.3f %12.3f %10.2f\n", t, k, r.switches, r.avoided, r.imported_kwh, r.exported_kwh, r.ev_kwh, r.cost);
+			runs++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "%zu readings from %.1f days, %lu run(s) in %.3f s (%.1f million readings/s)\n", n,
+	        (samples[n - 1].time - samples[0].time) / 86400.0, runs, seconds, seconds > 0 ? n * runs / seconds / 1e6 : 0);
+	free(samples);
+	free(tariffs);
+	return 0;
+}
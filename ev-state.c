@@ -0,0 +1,155 @@
+/*****************************************************************************
+ *                                                                           *
+ * Copyright (C) 2016-2021, Greg Stevens, <greg@e-ctrl.com>                  *
+ *                                                                           *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell  *
+ * copies of this Software, and permit persons to whom this Software is      *
+ * furnished to do so.                                                       *
+ *                                                                           *
+ * This Software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY *
+ * KIND, either expressed or implied.                                        *
+ *                                                                           *
+ *****************************************************************************
+
+Description:
+
+	Prints the state ev-charger publishes in shared memory: each site's last meter reading and cycle,
+	and the mode and last switch result of each of its loads. The segment is mapped read-only and read
+	with state_read() (ev-charger.h), which never holds up ev-charger; a dashboard or bridge reads it
+	the same way.
+
+	ev-state [-w seconds] [segment]
+
+	segment is the shm_open() name, /ev-charger (STATE_SHM_NAME) if not given. With -w the state is
+	printed again every that many seconds.
+
+Use GNU toolchain; command line to compile:
+gcc -Wall -ggdb3 ev-state.c -oev-state.exe -lrt
+
+*/
+
+/* Include the needed libraries */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ev-charger.h"
+
+#define STATE_SHM_NAME "/ev-charger" /* Keep the same as in ev-charger.c */
+
+static const char *mode_names[] = { /* By the modes in ev-charger.h */
+   [OFF] = "OFF",
+   [ON] = "ON",
+   [ON_ERROR] = "ON_ERROR",
+   [OFF_ERROR] = "OFF_ERROR",
+   [ON_VC] = "ON_VC",
+   [ON_VC_ERROR] = "ON_VC_ERROR",
+   [OFF_CURRENT] = "OFF_CURRENT",
+   [OFF_VALUE] = "OFF_VALUE",
+   [ON_STARTUP] = "ON_STARTUP",
+};
+
+static const char *switch_name(int result) {
+
+	return result == 1 ? "on" : result == 0 ? "off" : "-";
+}
+
+static void print_time(const char *label, int64_t when) {
+
+	char text[20] = "-";
+	time_t t = when;
+
+	if (when) {
+		strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	}
+	printf("%s%s", label, text);
+}
+
+static void print_state(const struct state_header *header, struct state_site *copy) {
+
+	/* Print every site's record as it is now */
+
+	for (uint32_t i = 0; state_read(header, i, copy, header->site_size); i++) {
+		printf("%s%s", copy->name[0] ? copy->name : "site", copy->name[0] ? ":" : "");
+		print_time(" cycle ", copy->time);
+		print_time(", reading ", copy->reading_time);
+		printf(", %.3f kW (smoothed house %.3f kW), %s, switch %s, %llu cycles%s%s\n", copy->actual_demand, copy->house,
+		       copy->value_charge ? "Value Charge" : "not Value Charge", switch_name(copy->switch_result), (unsigned long long)copy->cycles,
+		       (copy->flags & SAMPLE_METER_FAILED) ? ", meter failed" : "", (copy->flags & SAMPLE_SWITCH_FAILED) ? ", switch failed" : "");
+		for (uint32_t j = 0; j < header->loads; j++) {
+			const struct state_load *l = &copy->loads[j];
+			printf("  %-24s %-11s switch %-3s", l->name,
+			       (l->mode >= 0 && l->mode < (int)(sizeof(mode_names) / sizeof(mode_names[0])) && mode_names[l->mode]) ? mode_names[l->mode] : "?",
+			       switch_name(l->switch_result));
+			if (l->amps) {
+				printf(" %d A", l->amps);
+			}
+			print_time(" since ", l->changed);
+			printf("\n");
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+
+	const char *name = STATE_SHM_NAME;
+	int every = 0;
+	struct stat st;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-w") && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+			every = atoi(argv[++i]);
+		} else if (argv[i][0] == '/') {
+			name = argv[i];
+		} else {
+			fprintf(stderr, "Usage: %s [-w seconds] [segment]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(name);
+		return 1;
+	}
+	if ((size_t)st.st_size < sizeof(struct state_header)) {
+		fprintf(stderr, "%s: not ev-charger's state\n", name);
+		return 1;
+	}
+	const struct state_header *header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) {
+		perror(name);
+		return 1;
+	}
+	if (memcmp(header->magic, STATE_MAGIC, sizeof(header->magic)) || header->version != STATE_VERSION ||
+	    header->site_size < sizeof(struct state_site) + header->loads * sizeof(struct state_load) ||
+	    (uint64_t)st.st_size < sizeof(*header) + (uint64_t)header->sites * header->site_size) {
+		fprintf(stderr, "%s: not ev-charger's state, or from a different version of ev-charger\n", name);
+		return 1;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE); // The rest of the header is read after the magic
+
+	struct state_site *copy = malloc(header->site_size);
+	if (!copy) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	while (1) {
+		print_time("ev-charger ", header->started);
+		printf(" (pid %d%s)\n", header->pid, kill(header->pid, 0) == 0 ? "" : ", not running");
+		print_state(header, copy);
+		if (!every) {
+			break;
+		}
+		fflush(stdout);
+		sleep(every);
+		printf("\n");
+	}
+	free(copy);
+	return 0;
+}
@@ -0,0 +1,136 @@
+/*****************************************************************************
+ *                                                                           *
+ * Copyright (C) 2016-2021, Greg Stevens, <greg@e-ctrl.com>                  *
+ *                                                                           *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell  *
+ * copies of this Software, and permit persons to whom this Software is      *
+ * furnished to do so.                                                       *
+ *                                                                           *
+ * This Software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY *
+ * KIND, either expressed or implied.                                        *
+ *                                                                           *
+ *****************************************************************************
+
+Description:
+
+	The time-of-use electricity plan, shared by ev-charger and ev-replay. The plan is written as a
+	list of rules (months, days of the week or holidays, and a time of day) that put each minute in a
+	tier; later rules win. It is compiled into a table with the tier of every minute of a week of
+	real time, so looking up the tier is one array index (tariff_at() in ev-charger.h), and with the
+	minute of the next tier change so the scheduler can sleep right up to it. The table is compiled
+	again when a lookup falls outside the week it covers.
+
+	Compiled in with ev-charger.c, ev-replay.c and ev-charger-lite.c; see their command lines.
+
+*/
+
+/* Include the needed libraries */
+#include <string.h>
+#include <time.h>
+#include "ev-charger.h"
+
+/* The plan: PG&E EV rate. Value Charge (the least expensive tier) is from 11pm to 7am every day;
+   the rest of the day is part-peak, except for the peak from 2pm to 9pm on weekdays and from 3pm to
+   7pm on weekends and holidays. Summer is May to October. Rates are $ per kWh. */
+#define SUMMER (TARIFF_MONTH(5) | TARIFF_MONTH(6) | TARIFF_MONTH(7) | TARIFF_MONTH(8) | TARIFF_MONTH(9) | TARIFF_MONTH(10))
+#define WINTER (TARIFF_ALL_MONTHS & ~SUMMER)
+
+enum { TIER_VALUE_CHARGE, TIER_SUMMER_PART_PEAK, TIER_SUMMER_PEAK, TIER_WINTER_PART_PEAK, TIER_WINTER_PEAK };
+
+static const struct tariff_tier tiers[] = {
+	[TIER_VALUE_CHARGE] =     { "Value Charge", 0.13, 1 },
+	[TIER_SUMMER_PART_PEAK] = { "Summer part-peak", 0.28, 0 },
+	[TIER_SUMMER_PEAK] =      { "Summer peak", 0.49, 0 },
+	[TIER_WINTER_PART_PEAK] = { "Winter part-peak", 0.26, 0 },
+	[TIER_WINTER_PEAK] =      { "Winter peak", 0.35, 0 },
+};
+
+static const struct tariff_rule rules[] = {
+	/* The day starts out part-peak, then the peaks and Value Charge go over it */
+	{ TIER_SUMMER_PART_PEAK, SUMMER, TARIFF_ALL_DAYS, 7 * 60, 23 * 60 },
+	{ TIER_WINTER_PART_PEAK, WINTER, TARIFF_ALL_DAYS, 7 * 60, 23 * 60 },
+	{ TIER_SUMMER_PEAK, SUMMER, TARIFF_WEEKDAYS, 14 * 60, 21 * 60 },
+	{ TIER_WINTER_PEAK, WINTER, TARIFF_WEEKDAYS, 14 * 60, 21 * 60 },
+	{ TIER_SUMMER_PEAK, SUMMER, TARIFF_WEEKENDS, 15 * 60, 19 * 60 },
+	{ TIER_WINTER_PEAK, WINTER, TARIFF_WEEKENDS, 15 * 60, 19 * 60 },
+	{ TIER_VALUE_CHARGE, TARIFF_ALL_MONTHS, TARIFF_ALL_DAYS, 23 * 60, 7 * 60 },
+};
+
+/* Holidays are billed like weekends: MMDD for the same date every year, YYYYMMDD for one year only */
+static const int holidays[] = {
+	101, 704, 1111, 1225,                                      // New Year's Day, Independence Day, Veterans Day, Christmas
+	20210215, 20210531, 20210906, 20211125,                    // Presidents' Day, Memorial Day, Labor Day, Thanksgiving
+	20220221, 20220530, 20220905, 20221124,
+};
+
+const struct tariff tariff_plan = {
+	tiers, sizeof(tiers) / sizeof(tiers[0]),
+	rules, sizeof(rules) / sizeof(rules[0]),
+	holidays, sizeof(holidays) / sizeof(holidays[0]),
+};
+
+static int tariff_holiday(const struct tariff *tariff, const struct tm *tm) {
+
+	/* Returns 1 if the day is one of the plan's holidays */
+
+	int mmdd = (tm->tm_mon + 1) * 100 + tm->tm_mday;
+	int date = (tm->tm_year + 1900) * 10000 + mmdd;
+
+	for (int i = 0; i < tariff->nholidays; i++) {
+		if (tariff->holidays[i] == mmdd || tariff->holidays[i] == date) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int tariff_rule_tier(const struct tariff *tariff, unsigned month, unsigned day, int minute) {
+
+	/* The tier of one minute of the day: the last rule that covers it, or the first tier if none does */
+
+	int tier = 0;
+
+	for (int i = 0; i < tariff->nrules; i++) {
+		const struct tariff_rule *r = &tariff->rules[i];
+		int in_time = r->start_minute <= r->end_minute ? (minute >= r->start_minute && minute < r->end_minute)
+		                                               : (minute >= r->start_minute || minute < r->end_minute);
+		if ((r->months & month) && (r->days & day) && in_time) {
+			tier = r->tier;
+		}
+	}
+	return tier;
+}
+
+void tariff_compile(struct tariff_table *table, const struct tariff *tariff, int64_t when) {
+
+	/* Fill the table for the week of real time starting at local midnight of the day 'when' is in.
+	   Local time is worked out once an hour of the week, which follows daylight saving changes. */
+
+	time_t t = when;
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	table->tariff = tariff;
+	table->start = mktime(&tm);
+
+	for (int hour = 0; hour < TARIFF_MINUTES / 60; hour++) {
+		t = table->start + hour * 3600;
+		localtime_r(&t, &tm);
+
+		unsigned month = TARIFF_MONTH(tm.tm_mon + 1);
+		unsigned day = tariff_holiday(tariff, &tm) ? TARIFF_HOLIDAY : 1u << tm.tm_wday;
+		int minute_of_day = tm.tm_hour * 60 + tm.tm_min;
+
+		for (int m = 0; m < 60; m++) {
+			table->tier[hour * 60 + m] = tariff_rule_tier(tariff, month, day, (minute_of_day + m) % 1440);
+		}
+	}
+
+	/* Working back from the end, each minute's next change is the next minute if that is in another tier */
+	table->next[TARIFF_MINUTES - 1] = TARIFF_MINUTES;
+	for (int m = TARIFF_MINUTES - 2; m >= 0; m--) {
+		table->next[m] = table->tier[m + 1] != table->tier[m] ? m + 1 : table->next[m + 1];
+	}
+}